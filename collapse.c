@@ -1,3 +1,5 @@
+/* pread/pwrite/ftruncate with -std=c99 */
+#define _DEFAULT_SOURCE
 #include "SDL_render.h"
 #include "SDL_surface.h"
 #include "SDL_surface.h"
@@ -5,8 +7,13 @@
 #include <SDL_pixels.h>
 #include <SDL_image.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 
-#define MAX_TILES 4096
+#define MAX_TILES 65536
 #define BITS 64
 
 float my_random(void)
@@ -43,13 +50,41 @@ int select_by_weight(int cnt, struct weighted_element *elements)
   return ret;
 }
 
+/* two level bitset
+ *
+ * bit i of summary[j] is set if data[j * BITS + i] may be non-zero, all
+ * operations only visit the words of set summary bits. bitfield32 is the
+ * full width form used while building a set, bitfield32_sparse is the
+ * packed form that is stored: only the non-empty words are kept.
+ */
+#define BITFIELD_WORDS (MAX_TILES / BITS)
+#define BITFIELD_SUMMARY_WORDS (BITFIELD_WORDS / BITS)
+
 typedef struct bitfield32_st {
   int bitcount_needs_update;
   int bitcount;
   float entropy; /* used external */
-  uint64_t data[MAX_TILES / BITS];
+  uint64_t summary[BITFIELD_SUMMARY_WORDS];
+  uint64_t data[BITFIELD_WORDS];
 } bitfield32;
 
+typedef struct bitfield32_sparse_st {
+  int bitcount;
+  float entropy; /* used external */
+  int word_cnt;
+  uint64_t summary[BITFIELD_SUMMARY_WORDS];   /* exact, every stored word is non-zero */
+  uint16_t rank[BITFIELD_SUMMARY_WORDS];      /* stored words before summary[j] */
+  uint64_t *data;
+} bitfield32_sparse;
+
+/* calls body with w set to the index of every data word marked in summary */
+#define BITFIELD_FOREACH_WORD(summary, w, body) \
+  for (int summary_i_ = 0; summary_i_ < BITFIELD_SUMMARY_WORDS; ++summary_i_) { \
+    for (uint64_t m_ = (summary)[summary_i_]; m_; m_ &= m_ - 1) { \
+      int w = summary_i_ * BITS + __builtin_ctzll(m_); \
+      body \
+    } \
+  }
 
 static int bitcount(uint32_t i)
 {
@@ -63,10 +98,10 @@ static int bitcount(uint32_t i)
 void bitfield32_update_bitcount(bitfield32 *b)
 {
   b->bitcount = 0;
-  for (int i = 0; i < MAX_TILES / BITS; ++i) {
+  BITFIELD_FOREACH_WORD(b->summary, i, {
     b->bitcount += bitcount(b->data[i] >> 32);
     b->bitcount += bitcount(b->data[i] & 0xFFFFFFFFUL);
-  }
+  })
 }
 
 int bitfield32_get_bitcount(bitfield32 *bf)
@@ -81,8 +116,12 @@ int bitfield32_get_bitcount(bitfield32 *bf)
 int bitfield32_cmp(bitfield32 *a, bitfield32 *b)
 {
   int ret = 1;
-  for(int i= 0 ; i < MAX_TILES / BITS; ++i) {
-    ret = (ret && a->data[i] == b->data[i]);
+  for(int i= 0 ; i < BITFIELD_SUMMARY_WORDS; ++i) {
+    uint64_t m = a->summary[i] | b->summary[i];
+    for (; m; m &= m - 1) {
+      int w = i * BITS + __builtin_ctzll(m);
+      ret = (ret && a->data[w] == b->data[w]);
+    }
   }
   return ret;
 }
@@ -92,14 +131,31 @@ void bitfield32_set_bit(bitfield32 *bf, int bit)
   assert(bit < MAX_TILES);
   bf->bitcount_needs_update = 1;
   bf->data[bit / BITS] |= (1UL << (bit % BITS));
+  bf->summary[bit / BITS / BITS] |= (1UL << (bit / BITS % BITS));
+}
+
+int bitfield32_get_bit(bitfield32 *bf, int bit)
+{
+  return !!(bf->data[bit / BITS] & (1UL << (bit % BITS)));
+}
+
+/* clears all bits, only touches the used words */
+void bitfield32_clear(bitfield32 *bf)
+{
+  BITFIELD_FOREACH_WORD(bf->summary, i, {
+    bf->data[i] = 0;
+  })
+  memset(bf->summary, 0, sizeof(bf->summary));
+  bf->bitcount_needs_update = 0;
+  bf->bitcount = 0;
 }
 
 void bitfield32_set_to(bitfield32 *bf, int bit)
 {
+  bitfield32_clear(bf);
+  bitfield32_set_bit(bf, bit);
   bf->bitcount_needs_update = 0;
   bf->bitcount = 1;
-  memset(&bf->data, 0, sizeof(bf->data));
-  bf->data[bit / BITS] = 1UL << (bit % BITS);
 }
 
 void bitfield32_unset_bit(bitfield32 *bf, int bit)
@@ -108,44 +164,176 @@ void bitfield32_unset_bit(bitfield32 *bf, int bit)
   bf->data[bit / BITS] &= ~(1UL << (bit % BITS));
 }
 
-static void bitfield32_and(bitfield32 *a, bitfield32 *b)
+void bitfield32_or(bitfield32 *a, bitfield32 *b)
 {
   a->bitcount_needs_update = 1;
-  for(int i = 0; i < MAX_TILES / BITS; ++i) {
-    a->data[i] &= b->data[i];
+  BITFIELD_FOREACH_WORD(b->summary, i, {
+    a->data[i] |= b->data[i];
+  })
+  for (int i = 0; i < BITFIELD_SUMMARY_WORDS; ++i) {
+    a->summary[i] |= b->summary[i];
   }
 }
 
-void bitfield32_or(bitfield32 *a, bitfield32 *b)
+void bitfield32_or_sparse(bitfield32 *a, bitfield32_sparse *b)
 {
+  int pos = 0;
   a->bitcount_needs_update = 1;
-  for(int i = 0; i < MAX_TILES / BITS; ++i) {
-    a->data[i] |= b->data[i];
+  BITFIELD_FOREACH_WORD(b->summary, i, {
+    a->data[i] |= b->data[pos++];
+  })
+  for (int i = 0; i < BITFIELD_SUMMARY_WORDS; ++i) {
+    a->summary[i] |= b->summary[i];
+  }
+}
+
+/* packs bf into out, the words are written to data (BITFIELD_WORDS at most) */
+void bitfield32_pack(bitfield32 *bf, bitfield32_sparse *out, uint64_t *data)
+{
+  out->bitcount = 0;
+  out->word_cnt = 0;
+  out->data = data;
+  for (int i = 0; i < BITFIELD_SUMMARY_WORDS; ++i) {
+    out->rank[i] = out->word_cnt;
+    out->summary[i] = 0;
+    for (uint64_t m = bf->summary[i]; m; m &= m - 1) {
+      int b = __builtin_ctzll(m);
+      uint64_t word = bf->data[i * BITS + b];
+      if (word) {
+        out->summary[i] |= 1UL << b;
+        data[out->word_cnt++] = word;
+        out->bitcount += __builtin_popcountll(word);
+      }
+    }
+  }
+}
+
+static inline uint64_t bitfield32_sparse_word(bitfield32_sparse *bf, int word)
+{
+  uint64_t summary = bf->summary[word / BITS];
+  uint64_t bit = 1UL << (word % BITS);
+  if (!(summary & bit)) {
+    return 0;
   }
+  return bf->data[bf->rank[word / BITS] + __builtin_popcountll(summary & (bit - 1))];
+}
+
+int bitfield32_sparse_get_bit(bitfield32_sparse *bf, int bit)
+{
+  return !!(bitfield32_sparse_word(bf, bit / BITS) & (1UL << (bit % BITS)));
+}
+
+/* out = a & b, the words are written to data */
+void bitfield32_sparse_and(bitfield32_sparse *a, bitfield32_sparse *b, bitfield32_sparse *out, uint64_t *data)
+{
+  out->bitcount = 0;
+  out->word_cnt = 0;
+  out->data = data;
+  for (int i = 0; i < BITFIELD_SUMMARY_WORDS; ++i) {
+    out->rank[i] = out->word_cnt;
+    out->summary[i] = 0;
+    uint64_t sa = a->summary[i];
+    uint64_t sb = b->summary[i];
+    for (uint64_t m = sa & sb; m; m &= m - 1) {
+      uint64_t bit = m & -m;
+      uint64_t word = a->data[a->rank[i] + __builtin_popcountll(sa & (bit - 1))] &
+        b->data[b->rank[i] + __builtin_popcountll(sb & (bit - 1))];
+      if (word) {
+        out->summary[i] |= bit;
+        data[out->word_cnt++] = word;
+        out->bitcount += __builtin_popcountll(word);
+      }
+    }
+  }
+}
+
+int bitfield32_sparse_cmp(bitfield32_sparse *a, bitfield32_sparse *b)
+{
+  return a->word_cnt == b->word_cnt &&
+    !memcmp(a->summary, b->summary, sizeof(a->summary)) &&
+    !memcmp(a->data, b->data, sizeof(*a->data) * a->word_cnt);
 }
 
 typedef struct bitfield32_iter_st {
-  bitfield32 *bits;
-  int pos;
-  int bc;
+  bitfield32_sparse *bits;
+  int summary;          /* current summary word */
+  uint64_t words;       /* words of the current summary word not visited yet */
+  int word;             /* index of the current word */
+  uint64_t word_bits;   /* bits of the current word not returned yet */
+  int pos;              /* next stored word */
 } bitfield32_iter;
 
-bitfield32_iter bitfield32_get_iter(bitfield32 *bf)
+bitfield32_iter bitfield32_get_iter(bitfield32_sparse *bf)
 {
-  bitfield32_iter ret = {bf, 0, bitfield32_get_bitcount(bf)};
+  bitfield32_iter ret = {bf, -1, 0, 0, 0, 0};
   return ret;
 }
 
 int bitfield32_iter_next(bitfield32_iter *iter) {
-  while (iter->bc && iter->pos < MAX_TILES) {
-    if (iter->bits->data[iter->pos / BITS] & (1UL << (iter->pos % BITS))) {
-      iter->bc -= 1;
-      iter->pos += 1;
-      return iter->pos -1;
+  while (!iter->word_bits) {
+    while (!iter->words) {
+      if (++iter->summary >= BITFIELD_SUMMARY_WORDS) {
+        return -1;
+      }
+      iter->words = iter->bits->summary[iter->summary];
     }
-    iter->pos ++;
+    iter->word = iter->summary * BITS + __builtin_ctzll(iter->words);
+    iter->words &= iter->words - 1;
+    iter->word_bits = iter->bits->data[iter->pos++];
   }
-  return -1;
+  int bit = __builtin_ctzll(iter->word_bits);
+  iter->word_bits &= iter->word_bits - 1;
+  return iter->word * BITS + bit;
+}
+
+/* append only storage for packed words, words never move */
+#define WORD_ARENA_BLOCK (64 * 1024)
+
+struct word_arena {
+  uint64_t **blocks;
+  int block_cnt;
+  int block_used;           /* blocks in use, see word_arena_rewind */
+  int used;                 /* words used in the last block in use */
+};
+
+uint64_t *word_arena_alloc(struct word_arena *arena, int cnt)
+{
+  assert(cnt <= WORD_ARENA_BLOCK);
+  if (!arena->block_used || arena->used + cnt > WORD_ARENA_BLOCK) {
+    if (arena->block_used == arena->block_cnt) {
+      arena->blocks = realloc(arena->blocks, sizeof(*arena->blocks) * (arena->block_cnt + 1));
+      arena->blocks[arena->block_cnt++] = malloc(sizeof(uint64_t) * WORD_ARENA_BLOCK);
+    }
+    arena->block_used += 1;
+    arena->used = 0;
+  }
+  uint64_t *ret = &arena->blocks[arena->block_used - 1][arena->used];
+  arena->used += cnt;
+  return ret;
+}
+
+/* drops all words but keeps the blocks for the next ones */
+void word_arena_rewind(struct word_arena *arena)
+{
+  arena->block_used = 0;
+  arena->used = 0;
+}
+
+/* copies the words of bf to the arena */
+void bitfield32_sparse_store(bitfield32_sparse *bf, struct word_arena *arena)
+{
+  uint64_t *data = word_arena_alloc(arena, bf->word_cnt);
+  memcpy(data, bf->data, sizeof(*data) * bf->word_cnt);
+  bf->data = data;
+}
+
+void word_arena_free(struct word_arena *arena)
+{
+  for (int i = 0; i < arena->block_cnt; ++i) {
+    free(arena->blocks[i]);
+  }
+  free(arena->blocks);
+  memset(arena, 0, sizeof(*arena));
 }
 
 #define SCREEN_WIDTH 800
@@ -200,7 +388,7 @@ uint32_t murmur3_32(const uint8_t* key, size_t len, uint32_t seed)
 }
 
 
-static uint32_t adler32(char* key, size_t len)
+static uint32_t tile_hash(char* key, size_t len)
 {
   return murmur3_32((const uint8_t *)key, len, 123456);
 }
@@ -228,72 +416,209 @@ SDL_Surface *load_surface(char *data)
   return surface;
 }
 
-typedef bitfield32 (*allowed_neighbours_cache)[4];
+/* pattern pixels are indices into the palette of the input image, they
+ * are expanded to rgba only for the output. a pixel takes as many words
+ * as the palette of the image needs (pixel_words), one for up to 256
+ * colours */
+typedef uint8_t colour_index;
+
+/* the palette index of the pixel at p, the low word first */
+static inline uint32_t colour_get(colour_index *p, int words)
+{
+  uint32_t v = p[0];
+  for (int i = 1; i < words; ++i) {
+    v |= (uint32_t)p[i] << (8 * sizeof(*p) * i);
+  }
+  return v;
+}
+
+static inline void colour_put(colour_index *p, int words, uint32_t v)
+{
+  for (int i = 0; i < words; ++i) {
+    p[i] = v >> (8 * sizeof(*p) * i);
+  }
+}
 
+/* tiles are stored as arrays indexed by tile id, the hot loops only touch
+ * the arrays they need. the solver works on tiles, a tile stands for one
+ * or more patterns of the image, see overlap_minimize */
 struct analyse_result {
   int tile_size;
   int tile_count;
-  struct tiles {
-    uint32_t *tile_data;         /* bit data from surface */
-    SDL_Rect rect;              /* position of tile */
-    uint32_t bit;               /* bit-id */
-    uint32_t hash;              /* hash value of tile */
-    uint32_t hash_dir[4];       /* hash value for each side */
-    bitfield32 allowed_neighbours[4];
-    float weight;
-  } *tiles;
+  int tile_capacity;
+  colour_index *tile_data;      /* tile_size * tile_size pixels per pattern */
+  uint32_t *palette;
+  int palette_count;
+  int pixel_words;              /* colour_index words per pixel, see colour_get */
+  uint64_t *hashes;             /* hash value of pattern, see pattern_source_hash */
+  int pattern_count;
+  int *members;                 /* patterns of tile t: members[member_first[t]..member_first[t + 1]] */
+  int *member_first;
+  float *member_weights;        /* weight of the pattern members[i] */
+  float *weights;
+  float *weight_log_weights;    /* weight * logf(weight) */
+  uint32_t *colours;            /* preview colour (top left pixel, tile average if tiled) */
+  SDL_Rect *rects;              /* position of tile in texture */
+  bitfield32_sparse *allowed_neighbours;  /* dir * tile_count + tile */
+  struct word_arena words;      /* words of allowed_neighbours, direction major */
   uint32_t map_width;
   uint32_t map_height;
-  uint32_t *map;
+  uint32_t *map;                /* tile id of every window of the input, TILE_NONE if pruned */
   SDL_Texture *texture;
+  int tiled;                    /* simple tiled model, a cell is a whole tile */
+  uint32_t ruleset_hash;        /* patterns, palette and analysis flags, see map_file_header */
 };
 
+static inline colour_index *tile_get_data(struct analyse_result *res, int pattern)
+{
+  return &res->tile_data[pattern * res->tile_size * res->tile_size * res->pixel_words];
+}
+
+/* the pattern written for a tile, patterns merged into one tile are
+ * picked by weight with hash (uniform 32 bits) */
+static int tile_pick_pattern(struct analyse_result *res, int tile, uint32_t hash)
+{
+  int first = res->member_first[tile];
+  int last = res->member_first[tile + 1] - 1;
+  float rnd = hash / 4294967296.0f * res->weights[tile];
+  for (int i = first; i < last; ++i) {
+    rnd -= res->member_weights[i];
+    if (rnd < 0) {
+      return res->members[i];
+    }
+  }
+  return res->members[last];
+}
+
+/* the image as palette indices of res->pixel_words words per pixel, NULL
+ * if it can't be loaded */
+colour_index *load_indexed_image(char *name, struct analyse_result *res, int *w, int *h)
+{
+  SDL_Surface *surface = load_surface(name);
+  if (!surface) {
+    return NULL;
+  }
+  *w = surface->w;
+  *h = surface->h;
+  uint32_t pixel_cnt = surface->w * surface->h;
+  uint32_t *index = malloc(sizeof(*index) * pixel_cnt);
+  /* colour -> palette index, open addressing, grown at half full */
+  int shift = 10;
+  uint32_t mask = (1u << shift) - 1;
+  int *slots = malloc(sizeof(*slots) * (mask + 1));
+  memset(slots, -1, sizeof(*slots) * (mask + 1));
+  int palette_cap = 256;
+  res->palette = malloc(sizeof(*res->palette) * palette_cap);
+  for (int y = 0; y < surface->h; ++y) {
+    uint32_t *row = (uint32_t *)((uint8_t *)surface->pixels + y * surface->pitch);
+    for (int x = 0; x < surface->w; ++x) {
+      uint32_t slot = (row[x] * 0x9e3779b1u) >> (32 - shift);
+      while (slots[slot] != -1 && res->palette[slots[slot]] != row[x]) {
+        slot = (slot + 1) & mask;
+      }
+      if (slots[slot] == -1) {
+        if (res->palette_count == palette_cap) {
+          palette_cap *= 2;
+          res->palette = realloc(res->palette, sizeof(*res->palette) * palette_cap);
+        }
+        res->palette[res->palette_count] = row[x];
+        slots[slot] = res->palette_count++;
+        if (2 * (uint32_t)res->palette_count > mask) {
+          shift += 1;
+          mask = (1u << shift) - 1;
+          slots = realloc(slots, sizeof(*slots) * (mask + 1));
+          memset(slots, -1, sizeof(*slots) * (mask + 1));
+          for (int i = 0; i < res->palette_count; ++i) {
+            slot = (res->palette[i] * 0x9e3779b1u) >> (32 - shift);
+            while (slots[slot] != -1) {
+              slot = (slot + 1) & mask;
+            }
+            slots[slot] = i;
+          }
+        }
+        index[y * surface->w + x] = res->palette_count - 1;
+      } else {
+        index[y * surface->w + x] = slots[slot];
+      }
+    }
+  }
+  free(slots);
+  SDL_FreeSurface(surface);
+  /* the index width is picked for the palette of this image */
+  int words = 1;
+  while (words < 4 && (uint64_t)res->palette_count > 1ull << (8 * sizeof(colour_index) * words)) {
+    words += 1;
+  }
+  res->pixel_words = words;
+  colour_index *ret = malloc(sizeof(*ret) * words * pixel_cnt);
+  for (uint32_t i = 0; i < pixel_cnt; ++i) {
+    colour_put(&ret[i * words], words, index[i]);
+  }
+  free(index);
+  return ret;
+}
+
+static inline bitfield32_sparse *tile_get_allowed_neighbours(struct analyse_result *res, int tile, int dir)
+{
+  return &res->allowed_neighbours[dir * res->tile_count + tile];
+}
+
 //shannon_entropy_for_square =
 //  log(sum(weight)) -
 //  (sum(weight * log(weight)) / sum(weight))
 //
-float get_entropy(bitfield32 *v, struct analyse_result *res)
+float get_entropy(bitfield32_sparse *v, struct analyse_result *res)
 {
   float sum = 0.0;
   float sum_weight_log = 0.0;
   bitfield32_iter i = bitfield32_get_iter(v);
   int id;
   while (-1 != (id = bitfield32_iter_next(&i))) {
-    float weight = res->tiles[id].weight;
-    sum += weight;
-    sum_weight_log += weight * logf(weight);
+    sum += res->weights[id];
+    sum_weight_log += res->weight_log_weights[id];
   }
   return logf(sum) - sum_weight_log / sum;
 }
 
 
-int select_tile_based_on_weight(bitfield32 *bits, struct analyse_result *result)
+/* select_by_weight over the set bits, the intervals are summed up twice
+ * instead of being stored so observing does not allocate */
+int select_tile_based_on_weight(bitfield32_sparse *bits, struct analyse_result *result)
 {
-  struct weighted_element e[MAX_TILES];
-  int cnt = 0;
-  bitfield32_iter i = bitfield32_get_iter(bits);
+  if (!bits->bitcount) {
+    return -1;
+  }
+  float last = 0;
   int id;
+  bitfield32_iter i = bitfield32_get_iter(bits);
+  while (-1 != (id = bitfield32_iter_next(&i))) {
+    last = result->weights[id] + last;
+  }
+  float rnd = my_random() * last;
+  int ret = -1;
+  int prev = -1;
+  last = 0;
+  i = bitfield32_get_iter(bits);
   while (-1 != (id = bitfield32_iter_next(&i))) {
-    e[cnt].weight = result->tiles[id].weight;
-    e[cnt].id = id;
-    cnt += 1;
+    float start = last;
+    last = result->weights[id] + last;
+    if (rnd >= start && rnd < last) {
+      ret = id;
+    }
+    prev = id;
   }
-  return select_by_weight(cnt, e);
+  return ret == -1 ? prev : ret;
 }
 
 void print_analyse_result(struct analyse_result *result)
 {
   for(int i = 0; i < result->tile_count; ++i) {
-    printf("tile %i (weight: %0.2f): hash:%x left: %x right: %x top: %x bottom: %x (%d, %d)\n",
+    printf("tile %i (weight: %0.2f): hash:%llx (%d, %d)\n",
         i,
-        result->tiles[i].weight,
-        result->tiles[i].hash,
-        result->tiles[i].hash_dir[LEFT],
-        result->tiles[i].hash_dir[RIGHT],
-        result->tiles[i].hash_dir[TOP],
-        result->tiles[i].hash_dir[BOTTOM],
-        result->tiles[i].rect.x,
-        result->tiles[i].rect.y);
+        result->weights[i],
+        (unsigned long long)result->hashes[i],
+        result->rects[i].x,
+        result->rects[i].y);
     printf("rules:\n");
 
   }
@@ -306,40 +631,28 @@ void print_analyse_result(struct analyse_result *result)
   }
 }
 
-uint32_t calculate_hash(enum direction_e direction, char *hash_buffer, int tile_size)
+uint32_t calculate_hash(enum direction_e direction, colour_index *tile_data, int tile_size, int words)
 {
-  char *v_buffer = NULL;
-  if (direction & (RIGHT | LEFT)) {
-    v_buffer = malloc(tile_size * 4);
-  }
-  int buffer_pos = 0;
-  uint32_t ret = 0;
-  switch (direction) {
-    case TOP:
-      ret = adler32(hash_buffer, tile_size * 4);
-      break;
-    case BOTTOM:
-      ret = adler32(&hash_buffer[4 * tile_size * (tile_size - 1)], tile_size * 4);
-      break;
-    case LEFT:
-      for (int i = 0; i < tile_size; ++i) {
-        for (int b = 0; b < 4; ++b) {
-          v_buffer[buffer_pos++] = hash_buffer[i * tile_size * 4 + b];
-        }
-      }
-      ret = adler32(v_buffer, tile_size * 4);
-      break;
-    case RIGHT:
-      for (int i = 0; i < tile_size; ++i) {
-        for (int b = 0; b < 4; ++b) {
-          v_buffer[buffer_pos++] = hash_buffer[i * tile_size * 4 + (tile_size - 1) * 4 + b];
-        }
-      }
-      ret = adler32(v_buffer, tile_size * 4);
-      break;
+  colour_index edge[tile_size * words];
+  for (int i = 0; i < tile_size; ++i) {
+    int pixel = 0;
+    switch (direction) {
+      case TOP:
+        pixel = i;
+        break;
+      case BOTTOM:
+        pixel = (tile_size - 1) * tile_size + i;
+        break;
+      case LEFT:
+        pixel = i * tile_size;
+        break;
+      case RIGHT:
+        pixel = i * tile_size + tile_size - 1;
+        break;
+    }
+    memcpy(&edge[i * words], &tile_data[pixel * words], words * sizeof(*edge));
   }
-  free(v_buffer);
-  return ret;
+  return tile_hash((char *)edge, sizeof(edge));
 }
 
 #if 0
@@ -369,49 +682,57 @@ int add_tile_to_index(struct analyse_result *ret, uint32_t hash, uint32_t direct
 }
 #endif
 
-int overlap_add_tile_to_index2(struct analyse_result *ret, uint32_t *tile_data)
+static inline void overlap_get_tile_data(colour_index *data, int data_w, int data_h, colour_index *ret, int x, int y, int width, int height)
 {
-  /* hash data */
-  uint32_t hash = murmur3_32((uint8_t*)tile_data, ret->tile_size * ret->tile_size * 4, 1234);
-  /* try to find tile (by hash) */
-  for (int i = 0; i < ret->tile_count; ++i) {
-    if (hash == ret->tiles[i].hash) {
-      /* if hash matches increment weight on tile */
-      ret->tiles[i].weight += 1;
-      return i;
+  if (x + width <= data_w && y + height <= data_h) {
+    /* the window does not wrap */
+    for(int tile_y = 0; tile_y < height; ++tile_y) {
+      memcpy(&ret[tile_y * width], &data[(y + tile_y) * data_w + x], width * sizeof(*ret));
+    }
+    return;
+  }
+  for(int tile_y = 0; tile_y < height; ++tile_y) {
+    for (int tile_x = 0; tile_x < width; ++tile_x) {
+      ret[tile_y * width + tile_x] = data[((y+tile_y) % data_h) * data_w + ((x+tile_x) % data_w)];
     }
   }
-  /* else add new element */
-  ret->tiles =  realloc(ret->tiles, (ret->tile_count +1) * sizeof(*ret->tiles));
-  struct tiles *new_entry = &ret->tiles[ret->tile_count++];
-  memset(new_entry, 0, sizeof(*new_entry));
-  new_entry->hash = hash;
-  new_entry->weight = 1;
-  new_entry->tile_data = malloc(sizeof(uint32_t) * ret->tile_size * ret->tile_size);
-  memcpy(new_entry->tile_data, tile_data, sizeof(uint32_t) * ret->tile_size * ret->tile_size);
-  return ret->tile_count - 1;
 }
 
-int overlap_tiles_attach(uint32_t *tile_a, uint32_t *tile_b, enum direction_e dir, int tile_size)
+/* the window at x, y of data holds the same words as tile */
+static inline int overlap_tile_equal(colour_index *data, int data_w, int data_h, colour_index *tile, int x, int y, int width, int height)
 {
+  for(int tile_y = 0; tile_y < height; ++tile_y) {
+    colour_index *row = &data[((y + tile_y) % data_h) * data_w];
+    for (int tile_x = 0; tile_x < width; ++tile_x) {
+      if (tile[tile_y * width + tile_x] != row[(x + tile_x) % data_w]) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static inline int overlap_tiles_attach(colour_index *tile_a, colour_index *tile_b, enum direction_e dir, int tile_size, int words)
+{
+  int row = tile_size * words;
   switch (dir) {
     case TOP:
-      return !memcmp(tile_a, &tile_b[tile_size], tile_size * (tile_size - 1)* sizeof(*tile_a));
+      return !memcmp(tile_a, &tile_b[row], row * (tile_size - 1)* sizeof(*tile_a));
       break;
     case LEFT:
       for(int i = 0; i < tile_size; ++i) {
-        if (memcmp(&tile_a[i * tile_size], &tile_b[i * tile_size + 1], (tile_size - 1) * sizeof(*tile_a))) {
+        if (memcmp(&tile_a[i * row], &tile_b[i * row + words], (row - words) * sizeof(*tile_a))) {
           return 0;
         }
       }
       return 1;
       break;
     case BOTTOM:
-      return !memcmp(&tile_a[tile_size], tile_b, tile_size * (tile_size - 1) * sizeof(*tile_a));
+      return !memcmp(&tile_a[row], tile_b, row * (tile_size - 1) * sizeof(*tile_a));
       break;
     case RIGHT:
       for(int i = 0; i < tile_size; ++i) {
-        if (memcmp(&tile_a[i * tile_size + 1], &tile_b[i * tile_size], (tile_size - 1) * sizeof(*tile_a))) {
+        if (memcmp(&tile_a[i * row + words], &tile_b[i * row], (row - words) * sizeof(*tile_a))) {
           return 0;
         }
       }
@@ -422,650 +743,3951 @@ int overlap_tiles_attach(uint32_t *tile_a, uint32_t *tile_b, enum direction_e di
   return -1;
 }
 
-void overlap_get_tile_data(uint32_t *data, int data_w, int data_h, uint32_t *ret, int x, int y, int width, int height)
-{
-  for(int tile_y = 0; tile_y < height; ++tile_y) {
-    for (int tile_x = 0; tile_x < width; ++tile_x) {
-      ret[tile_y * width + tile_x] = data[((y+tile_y) % data_h) * data_w + ((x+tile_x) % data_w)];
-    }
-  }
-}
-
-void overlap_analyse_tiles(struct analyse_result *res)
+/* sets the bit of every tile b that overlaps tile a shifted by one cell in dir */
+static inline void overlap_attach_row(struct analyse_result *res, colour_index *tile_a, enum direction_e dir, bitfield32 *allowed, int tile_size, int words)
 {
-  for(int tile_a = 0; tile_a < res->tile_count; ++tile_a) {
-    for( int tile_b = 0; tile_b < res->tile_count; ++tile_b) {
-      for(int dir = 0; dir < 4; ++dir) {
-        if (overlap_tiles_attach(res->tiles[tile_a].tile_data, res->tiles[tile_b].tile_data, dir, res->tile_size)) {
-          bitfield32_set_bit(&res->tiles[tile_a].allowed_neighbours[dir], tile_b);
-        }
-      }
+  colour_index *tile_b = res->tile_data;
+  for (int i = 0; i < res->tile_count; ++i, tile_b += tile_size * tile_size * words) {
+    if (overlap_tiles_attach(tile_a, tile_b, dir, tile_size, words)) {
+      bitfield32_set_bit(allowed, i);
     }
   }
 }
 
+/* kernels for the common tile sizes of one word pixels, the constant size
+ * lets the compiler unroll the loops and turn the compares into a few
+ * fixed width loads */
+struct overlap_kernels {
+  int tile_size;            /* 0 for the generic kernels */
+  void (*get_tile_data)(colour_index *data, int data_w, int data_h, colour_index *ret, int x, int y, int width, int height);
+  void (*attach_row)(struct analyse_result *res, colour_index *tile_a, enum direction_e dir, bitfield32 *allowed);
+};
 
-SDL_Renderer *glob_renderer = NULL;
-
-void tile_data_mirror_v(uint32_t *tile_data, int tile_size)
-{
-  uint32_t c;
-  for(int y = 0; y< tile_size; ++y) {
-    for (int x = 0; x < tile_size / 2; ++x) {
-      c = tile_data[y * tile_size + x];
-      tile_data[y * tile_size + x] = tile_data[y * tile_size + tile_size - x - 1];
-      tile_data[y * tile_size + tile_size - x - 1] = c;
-    }
-  }
+#define OVERLAP_KERNELS(n) \
+static void overlap_get_tile_data_##n(colour_index *data, int data_w, int data_h, colour_index *ret, int x, int y, int width, int height) \
+{ \
+  overlap_get_tile_data(data, data_w, data_h, ret, x, y, n, n); \
+} \
+static void overlap_attach_row_##n(struct analyse_result *res, colour_index *tile_a, enum direction_e dir, bitfield32 *allowed) \
+{ \
+  overlap_attach_row(res, tile_a, dir, allowed, n, 1); \
 }
+OVERLAP_KERNELS(2)
+OVERLAP_KERNELS(3)
+OVERLAP_KERNELS(4)
+OVERLAP_KERNELS(5)
 
-void tile_data_mirror_h(uint32_t *tile_data, int tile_size)
+static void overlap_get_tile_data_generic(colour_index *data, int data_w, int data_h, colour_index *ret, int x, int y, int width, int height)
 {
-  uint32_t c[tile_size];
-  for(int y= 0; y < tile_size / 2; ++y) {
-    memcpy(c, &tile_data[y * tile_size], tile_size * sizeof(*tile_data));
-    memcpy(&tile_data[y * tile_size], &tile_data[(tile_size - y - 1) * tile_size], tile_size * sizeof(*tile_data));
-    memcpy(&tile_data[(tile_size - y - 1) * tile_size], c, tile_size * sizeof(*tile_data));
-  }
+  overlap_get_tile_data(data, data_w, data_h, ret, x, y, width, height);
 }
 
-void tile_data_rotate90(uint32_t *tile_data, int tile_size)
+static void overlap_attach_row_generic(struct analyse_result *res, colour_index *tile_a, enum direction_e dir, bitfield32 *allowed)
 {
-  uint32_t old[tile_size * tile_size];
-  memcpy(old, tile_data, sizeof(old));
-  for (int y = 0; y < tile_size; ++y) {
-    for (int x = 0; x < tile_size; ++x) {
-      tile_data[x * tile_size + (tile_size - y - 1)] = old[y * tile_size + x];
-    }
-  }
+  overlap_attach_row(res, tile_a, dir, allowed, res->tile_size, res->pixel_words);
 }
 
-#define ANALYZE_FLAG_NO_Y_WRAP 1
-#define ANALYZE_FLAG_NO_X_WRAP 2
-#define ANALYZE_FLAG_DO_MIRROR_V 4
-#define ANALYZE_FLAG_DO_MIRROR_H 8
-#define ANALYZE_FLAG_DO_ROTATE 16
-#define OUTPUT_FLAG_MAKE_SEAMLESS 32
+struct overlap_kernels overlap_kernels_table[] = {
+  {2, overlap_get_tile_data_2, overlap_attach_row_2},
+  {3, overlap_get_tile_data_3, overlap_attach_row_3},
+  {4, overlap_get_tile_data_4, overlap_attach_row_4},
+  {5, overlap_get_tile_data_5, overlap_attach_row_5},
+  {0, overlap_get_tile_data_generic, overlap_attach_row_generic},
+};
 
-struct analyse_result *overlap_analyse_image(char *name, int tile_size, int flags) {
-  struct analyse_result *ret = calloc(1, sizeof(*ret));
-  ret->tile_size = tile_size;
-  SDL_Surface *surface = load_surface(name);
-  int surface_width = surface->w;
-  int surface_height = surface->h;
-  uint32_t *tile_data = malloc(sizeof(uint32_t) * ret->tile_size * ret->tile_size);
-  for (int y = 0; y < surface_height - (flags & ANALYZE_FLAG_NO_Y_WRAP)?tile_size:0 ; ++y) {
-    for (int x = 0; x < surface_width - (flags & ANALYZE_FLAG_NO_X_WRAP)?tile_size:0; ++x) {
-      overlap_get_tile_data(surface->pixels, surface_width, surface_height, tile_data, x, y, ret->tile_size, ret->tile_size);
-      overlap_add_tile_to_index2(ret, tile_data);
-      if (flags & ANALYZE_FLAG_DO_ROTATE) {
-        tile_data_rotate90(tile_data, tile_size);
-        overlap_add_tile_to_index2(ret, tile_data);
-        tile_data_rotate90(tile_data, tile_size);
-        overlap_add_tile_to_index2(ret, tile_data);
-        tile_data_rotate90(tile_data, tile_size);
-        overlap_add_tile_to_index2(ret, tile_data);
-        tile_data_rotate90(tile_data, tile_size);
-      }
-      if (flags & ANALYZE_FLAG_DO_ROTATE && flags & ANALYZE_FLAG_DO_MIRROR_H && flags & ANALYZE_FLAG_DO_MIRROR_V) {
-          tile_data_mirror_v(tile_data, tile_size);
-          overlap_add_tile_to_index2(ret, tile_data);
-          tile_data_rotate90(tile_data, tile_size);
-          overlap_add_tile_to_index2(ret, tile_data);
-          tile_data_rotate90(tile_data, tile_size);
-          overlap_add_tile_to_index2(ret, tile_data);
-          tile_data_rotate90(tile_data, tile_size);
-          overlap_add_tile_to_index2(ret, tile_data);
-      } else {
-        if (flags & ANALYZE_FLAG_DO_MIRROR_V) {
-          tile_data_mirror_v(tile_data, tile_size);
-          overlap_add_tile_to_index2(ret, tile_data);
-          /* reset mirroring */
-          tile_data_mirror_v(tile_data, tile_size);
-        }
-        if (flags & ANALYZE_FLAG_DO_MIRROR_H) {
-          tile_data_mirror_h(tile_data, tile_size);
-          overlap_add_tile_to_index2(ret, tile_data);
-          /* reset mirroring */
-          tile_data_mirror_h(tile_data, tile_size);
-        }
-      }
-    }
-  }
-  overlap_analyse_tiles(ret);
-  uint32_t rmask = 0xff000000;
-  uint32_t gmask = 0x00ff0000;
-  uint32_t bmask = 0x0000ff00;
-  uint32_t amask = 0x000000ff;
-  int bpp = 0;
-  SDL_PixelFormatEnumToMasks (SDL_PIXELFORMAT_RGBA8888, &bpp, &rmask, &gmask, &bmask, &amask);
-  int surface_w = ceilf(sqrtf(ret->tile_count));
-  int surface_h = surface_w;
-  SDL_Surface *tmp_surface = SDL_CreateRGBSurface(0,
-      surface_w * ret->tile_size,
-      surface_h *  ret->tile_size,
-      32,
-      rmask, gmask, bmask, amask);
-  for (int i = 0; i < ret->tile_count; ++i) {
-    SDL_Surface *tile_surface =
-      SDL_CreateRGBSurfaceFrom(ret->tiles[i].tile_data,ret->tile_size, ret->tile_size, 32, ret->tile_size * 4, rmask, gmask, bmask, amask);
-    int x = i % surface_w;
-    int y = i / surface_w;
-    SDL_Rect src_rect = {0, 0, ret->tile_size, ret->tile_size};
-    SDL_Rect dst_rect = {x * ret->tile_size, y * ret->tile_size, ret->tile_size, ret->tile_size};
-    SDL_BlitSurface(tile_surface, &src_rect, tmp_surface, &dst_rect);
-    ret->tiles[i].rect.x = x * ret->tile_size;
-    ret->tiles[i].rect.y = y * ret->tile_size;
-    ret->tiles[i].rect.w = 1;
-    ret->tiles[i].rect.h = 1;
-  }
-  ret->texture = SDL_CreateTextureFromSurface(glob_renderer, tmp_surface);
-  SDL_FreeSurface(tmp_surface);
+struct overlap_kernels *overlap_kernels = &overlap_kernels_table[4];
 
-  return ret;
+static void overlap_kernels_select(int tile_size, int words)
+{
+  overlap_kernels = overlap_kernels_table;
+  while (overlap_kernels->tile_size && (words > 1 || overlap_kernels->tile_size != tile_size)) {
+    overlap_kernels += 1;
+  }
 }
 
+/* tile ids by hash, open addressing */
+struct tile_index {
+  uint32_t size;
+  int *slots;
+};
 
-void draw_rect(int x, int y, int w, int h, int r, int g, int b)
+/* the slot of the window at x, y of data or the free slot for it, a hash
+ * hit counts only if the pixels match. without data the free slot is
+ * returned */
+static int *tile_index_find(struct tile_index *index, struct analyse_result *ret, uint64_t hash, colour_index *data, int data_w, int data_h, int x, int y)
 {
-  SDL_Rect rect = {x, y, w, h};
-  SDL_SetRenderDrawColor(glob_renderer, r, g, b, 255);
-  SDL_RenderDrawRect(glob_renderer, &rect);
-  SDL_SetRenderDrawColor(glob_renderer, 0, 0, 0, 0);
+  uint32_t slot = (hash ^ (hash >> 32)) & (index->size - 1);
+  while (index->slots[slot] != -1) {
+    int id = index->slots[slot];
+    if (data && ret->hashes[id] == hash &&
+        overlap_tile_equal(data, data_w * ret->pixel_words, data_h, tile_get_data(ret, id),
+          x * ret->pixel_words, y, ret->tile_size * ret->pixel_words, ret->tile_size)) {
+      break;
+    }
+    slot = (slot + 1) & (index->size - 1);
+  }
+  return &index->slots[slot];
 }
 
-
-void draw_tile(int x, int y, int tile_id, struct analyse_result *res)
+static void tile_index_grow(struct tile_index *index, struct analyse_result *ret)
 {
-  SDL_SetTextureBlendMode(res->texture, SDL_BLENDMODE_NONE);
-  SDL_Rect rect = {x, y, res->tile_size, res->tile_size};
-  SDL_RenderCopy(glob_renderer, res->texture, &res->tiles[tile_id].rect, &rect);
+  index->size = index->size ? index->size * 2 : 1024;
+  free(index->slots);
+  index->slots = malloc(sizeof(*index->slots) * index->size);
+  memset(index->slots, -1, sizeof(*index->slots) * index->size);
+  for (int i = 0; i < ret->tile_count; ++i) {
+    *tile_index_find(index, ret, ret->hashes[i], NULL, 0, 0, 0, 0) = i;
+  }
 }
 
-void draw_tile_based_on_weight(int x, int y, bitfield32 *bits, struct analyse_result *res)
+/* the pixels are only copied for new tiles. data_w and x count pixels */
+int overlap_add_tile_to_index2(struct analyse_result *ret, struct tile_index *index, uint64_t hash, colour_index *data, int data_w, int data_h, int x, int y)
 {
-  float w[MAX_TILES] = {0.0};
-  float sum = 0;
-  int cnt = 0;
-  int ids[MAX_TILES];
-  bitfield32_iter iter = bitfield32_get_iter(bits);
-  int id;
-  while (-1 != (id = bitfield32_iter_next(&iter))) {
-    w[cnt] += res->tiles[id].weight;
-    ids[cnt] = id;
-    sum += res->tiles[id].weight;
-    cnt += 1;
+  if (2 * ret->tile_count >= index->size) {
+    tile_index_grow(index, ret);
   }
-  SDL_SetTextureBlendMode(res->texture, SDL_BLENDMODE_BLEND);
-  for (int i = 0; i < cnt; ++i) {
-    SDL_SetTextureAlphaMod(res->texture, (w[i] / sum) * 255.0);
-    //SDL_Rect rect = {x, y, res->tile_size, res->tile_size};
-    SDL_Rect rect = {x, y, 1, 1};
-    SDL_RenderCopy(glob_renderer, res->texture, &res->tiles[ids[i]].rect, &rect);
+  int *slot = tile_index_find(index, ret, hash, data, data_w, data_h, x, y);
+  if (*slot != -1) {
+    /* if hash matches increment weight on tile */
+    ret->weights[*slot] += 1;
+    return *slot;
+  }
+  /* else add new element */
+  int words = ret->pixel_words;
+  int pixels = ret->tile_size * ret->tile_size;
+  if (ret->tile_count == ret->tile_capacity) {
+    ret->tile_capacity = ret->tile_capacity ? ret->tile_capacity * 2 : 256;
+    ret->tile_data = realloc(ret->tile_data, sizeof(*ret->tile_data) * pixels * words * ret->tile_capacity);
+    ret->hashes = realloc(ret->hashes, sizeof(*ret->hashes) * ret->tile_capacity);
+    ret->weights = realloc(ret->weights, sizeof(*ret->weights) * ret->tile_capacity);
   }
+  int id = ret->tile_count++;
+  ret->hashes[id] = hash;
+  ret->weights[id] = 1;
+  overlap_kernels->get_tile_data(data, data_w * words, data_h, tile_get_data(ret, id), x * words, y, ret->tile_size * words, ret->tile_size);
+  *slot = id;
+  return id;
 }
 
-
-void draw_input_map(struct analyse_result *result)
+/* every tile b that overlaps tile a shifted by one cell in dir */
+static void overlap_build_adjacency(struct analyse_result *res, bitfield32 *allowed, uint64_t *data)
 {
-  for(int y = 0; y < result->map_height; ++y) {
-    for (int x = 0; x < result->map_width; ++x) {
-      draw_tile(x * result->tile_size, y * result->tile_size, result->map[y * result->map_width + x], result);
+  int cnt = res->tile_count;
+  for(int dir = 0; dir < 4; ++dir) {
+    for(int tile_a = 0; tile_a < cnt; ++tile_a) {
+      overlap_kernels->attach_row(res, tile_get_data(res, tile_a), dir, allowed);
+      bitfield32_sparse *row = tile_get_allowed_neighbours(res, tile_a, dir);
+      bitfield32_pack(allowed, row, data);
+      bitfield32_sparse_store(row, &res->words);
+      bitfield32_clear(allowed);
     }
   }
 }
 
-typedef struct bitfield32_map {
-  int map_width;
-  int map_height;
-  bitfield32 *map;
-  allowed_neighbours_cache cache;
-} bitfield32_map;
-
-void draw_map_with_weight(bitfield32_map *map, struct analyse_result *result)
+/* the edge of tile a in dir equals the opposite edge of tile b */
+int tiled_tiles_attach(colour_index *tile_a, colour_index *tile_b, enum direction_e dir, int tile_size, int words)
 {
-  for(int y = 0; y < map->map_height; ++y) {
-    for (int x = 0; x < map->map_width; ++x) {
-      draw_tile_based_on_weight(x, y, &map->map[y * map->map_width + x], result);
+  int last = tile_size - 1;
+  for (int i = 0; i < tile_size; ++i) {
+    int a = 0;
+    int b = 0;
+    switch (dir) {
+      case TOP:
+        a = i;
+        b = last * tile_size + i;
+        break;
+      case LEFT:
+        a = i * tile_size;
+        b = i * tile_size + last;
+        break;
+      case BOTTOM:
+        a = last * tile_size + i;
+        b = i;
+        break;
+      case RIGHT:
+        a = i * tile_size + last;
+        b = i * tile_size;
+        break;
+    }
+    if (memcmp(&tile_a[a * words], &tile_b[b * words], words * sizeof(*tile_a))) {
+      return 0;
     }
   }
+  return 1;
 }
 
-void split_pixel(uint32_t pixel, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a)
+/* simple tiled model: the tiles are bucketed by the hash of their edges,
+ * so only tiles with a matching edge are compared */
+static void tiled_build_adjacency(struct analyse_result *res, bitfield32 *allowed, uint64_t *data)
 {
-  *a = pixel & 0xff;
-  pixel >>= 8;
-  *b = pixel & 0xff;
-  pixel >>= 8;
-  *g = pixel & 0xff;
-  pixel >>= 8;
-  *r = pixel & 0xff;
+  int cnt = res->tile_count;
+  uint32_t *edges = malloc(sizeof(*edges) * 4 * cnt);
+  for (int dir = 0; dir < 4; ++dir) {
+    for (int tile = 0; tile < cnt; ++tile) {
+      edges[dir * cnt + tile] = calculate_hash(dir, tile_get_data(res, tile), res->tile_size, res->pixel_words);
+    }
+  }
+  uint32_t bucket_cnt = 16;
+  while (bucket_cnt < 2 * (uint32_t)cnt) {
+    bucket_cnt *= 2;
+  }
+  int *bucket = malloc(sizeof(*bucket) * bucket_cnt);
+  int *next = malloc(sizeof(*next) * cnt);
+  for (int dir = 0; dir < 4; ++dir) {
+    uint32_t *edge = &edges[dir * cnt];
+    uint32_t *oposite = &edges[OPOSITE_DIRECTION(dir) * cnt];
+    memset(bucket, -1, sizeof(*bucket) * bucket_cnt);
+    for (int tile_b = 0; tile_b < cnt; ++tile_b) {
+      uint32_t slot = oposite[tile_b] & (bucket_cnt - 1);
+      next[tile_b] = bucket[slot];
+      bucket[slot] = tile_b;
+    }
+    for (int tile_a = 0; tile_a < cnt; ++tile_a) {
+      for (int tile_b = bucket[edge[tile_a] & (bucket_cnt - 1)]; tile_b != -1; tile_b = next[tile_b]) {
+        if (oposite[tile_b] == edge[tile_a] &&
+            tiled_tiles_attach(tile_get_data(res, tile_a), tile_get_data(res, tile_b), dir, res->tile_size, res->pixel_words)) {
+          bitfield32_set_bit(allowed, tile_b);
+        }
+      }
+      bitfield32_sparse *row = tile_get_allowed_neighbours(res, tile_a, dir);
+      bitfield32_pack(allowed, row, data);
+      bitfield32_sparse_store(row, &res->words);
+      bitfield32_clear(allowed);
+    }
+  }
+  free(next);
+  free(bucket);
+  free(edges);
 }
 
-uint32_t merge_pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+/* average colour of a tile, the preview of the simple tiled model */
+static uint32_t tile_average_colour(struct analyse_result *res, int tile)
 {
+  int pixels = res->tile_size * res->tile_size;
+  colour_index *tile_data = tile_get_data(res, tile);
+  uint32_t sum[4] = {0};
+  for (int i = 0; i < pixels; ++i) {
+    for (int c = 0; c < 4; ++c) {
+      sum[c] += (res->palette[colour_get(&tile_data[i * res->pixel_words], res->pixel_words)] >> (24 - 8 * c)) & 0xff;
+    }
+  }
   uint32_t ret = 0;
-  ret |= r;
-  ret <<= 8;
-  ret |= g;
-  ret <<= 8;
-  ret |= b;
-  ret <<= 8;
-  ret |= a;
+  for (int c = 0; c < 4; ++c) {
+    ret = (ret << 8) | ((sum[c] + pixels / 2) / pixels);
+  }
   return ret;
 }
 
-void update_output_map(SDL_Surface *out, int x, int y, bitfield32_map *map, struct analyse_result *res)
+/* ruleset minimization
+ *
+ * a pattern without any neighbour in one direction can't be part of a
+ * (seamless) solution, it is removed and so are the patterns that lose
+ * their last neighbour in some direction with it. patterns with the same
+ * neighbours in every direction can't be told apart by the solver, they
+ * become one tile with the summed weight. the rows are unions of such
+ * groups, so one pass finds them. with the overlapping model equal rows
+ * mean equal patterns, merging only happens with the simple tiled model.
+ */
+static uint32_t overlap_rows_hash(struct analyse_result *res, int pattern, uint8_t *alive)
+{
+  uint32_t hash = 2166136261u;
+  for (int dir = 0; dir < 4; ++dir) {
+    bitfield32_iter iter = bitfield32_get_iter(tile_get_allowed_neighbours(res, pattern, dir));
+    int id;
+    while (-1 != (id = bitfield32_iter_next(&iter))) {
+      if (alive[id]) {
+        hash = (hash ^ id) * 16777619u;
+      }
+    }
+    hash = (hash ^ 0xffffffffu) * 16777619u;
+  }
+  return hash;
+}
+
+static int overlap_next_alive(bitfield32_iter *iter, uint8_t *alive)
 {
-  float w[MAX_TILES] = {0.0};
-  float sum = 0;
-  int cnt = 0;
-  int ids[MAX_TILES];
-  bitfield32_iter iter = bitfield32_get_iter(&map->map[map->map_width * y + x]);
   int id;
-  while (-1 != (id = bitfield32_iter_next(&iter))) {
-    w[cnt] += res->tiles[id].weight;
-    ids[cnt] = id;
-    sum += res->tiles[id].weight;
-    cnt += 1;
-  }
-  uint8_t out_r=0;
-  uint8_t out_g=0;
-  uint8_t out_b=0;
-  uint8_t out_a=0;
-  for (int i = 0; i < cnt; ++i) {
-    uint8_t tmp_r=0;
-    uint8_t tmp_g=0;
-    uint8_t tmp_b=0;
-    uint8_t tmp_a=0;
-    //SDL_SetTextureAlphaMod(res->texture, (w[i] / sum) * 255.0);
-    split_pixel(res->tiles[ids[i]].tile_data[0], &tmp_r, &tmp_g, &tmp_b, &tmp_a);
-    out_r += tmp_r * (float)w[i] / sum;
-    out_g += tmp_g * (float)w[i] / sum;
-    out_b += tmp_b * (float)w[i] / sum;
-    out_a += tmp_a * (float)w[i] / sum;
+  while (-1 != (id = bitfield32_iter_next(iter)) && !alive[id]) {
   }
-  uint32_t *map_data = out->pixels;
-  map_data[y * out->w + x] = merge_pixel(out_r, out_g, out_b, out_a);
+  return id;
 }
 
-void update_allowed_neighbours_cache(struct bitfield32_map *map, int x, int y, struct analyse_result *res)
+static int overlap_rows_equal(struct analyse_result *res, int a, int b, uint8_t *alive)
 {
   for (int dir = 0; dir < 4; ++dir) {
-    int id;
-    bitfield32 allowed_tiles = {0};
-    bitfield32_iter iter = bitfield32_get_iter(&map->map[map->map_width * y + x]);
-    while (-1 != (id = bitfield32_iter_next(&iter))) {
-      bitfield32_or(&allowed_tiles, &res->tiles[id].allowed_neighbours[dir]);
+    bitfield32_iter iter_a = bitfield32_get_iter(tile_get_allowed_neighbours(res, a, dir));
+    bitfield32_iter iter_b = bitfield32_get_iter(tile_get_allowed_neighbours(res, b, dir));
+    int id_a;
+    int id_b;
+    do {
+      id_a = overlap_next_alive(&iter_a, alive);
+      id_b = overlap_next_alive(&iter_b, alive);
+      if (id_a != id_b) {
+        return 0;
+      }
+    } while (id_a != -1);
+  }
+  return 1;
+}
+
+/* clears alive of the patterns without a neighbour in some direction,
+ * until none are left */
+static void overlap_prune(struct analyse_result *res, uint8_t *alive)
+{
+  int cnt = res->tile_count;
+  /* alive neighbours per pattern and direction, a pattern at 0 dies */
+  int *support = malloc(sizeof(*support) * 4 * cnt);
+  int *dead = malloc(sizeof(*dead) * cnt);
+  int dead_cnt = 0;
+  for (int tile = 0; tile < cnt; ++tile) {
+    for (int dir = 0; dir < 4; ++dir) {
+      support[dir * cnt + tile] = tile_get_allowed_neighbours(res, tile, dir)->bitcount;
+      if (!support[dir * cnt + tile] && alive[tile]) {
+        alive[tile] = 0;
+        dead[dead_cnt++] = tile;
+      }
+    }
+  }
+  for (int i = 0; i < dead_cnt; ++i) {
+    for (int dir = 0; dir < 4; ++dir) {
+      /* the adjacency is symmetric: b in row(a, dir) <=> a in row(b, oposite) */
+      bitfield32_iter iter = bitfield32_get_iter(tile_get_allowed_neighbours(res, dead[i], dir));
+      int id;
+      while (-1 != (id = bitfield32_iter_next(&iter))) {
+        if (!--support[OPOSITE_DIRECTION(dir) * cnt + id] && alive[id]) {
+          alive[id] = 0;
+          dead[dead_cnt++] = id;
+        }
+      }
     }
-    map->cache[map->map_width * y + x][dir] = allowed_tiles;
+  }
+  free(support);
+  free(dead);
+  if (dead_cnt == cnt) {
+    /* nothing can be solved seamless, the ruleset is kept as it was */
+    memset(alive, 1, cnt);
   }
 }
 
-void init_allowed_neighbours_cache(struct bitfield32_map *map, struct analyse_result *res)
+/* dead patterns are only pruned for seamless maps, a bounded map needs
+ * the patterns of its border */
+static void overlap_minimize(struct analyse_result *res, int seamless)
 {
-  map->cache = calloc(1, sizeof(*map->cache) * map->map_width * map->map_height);
-  for(int y = 0; y < map->map_height; ++y) {
-    for (int x = 0; x < map->map_width; ++x) {
-      update_allowed_neighbours_cache(map, x, y, res);
+  int cnt = res->tile_count;
+  uint8_t *alive = malloc(cnt);
+  memset(alive, 1, cnt);
+  if (seamless) {
+    overlap_prune(res, alive);
+  }
+  /* group the patterns with equal rows, tile ids follow the first pattern */
+  int *tile_of = malloc(sizeof(*tile_of) * cnt);
+  int *first = malloc(sizeof(*first) * cnt);
+  uint32_t *hashes = malloc(sizeof(*hashes) * cnt);
+  int *next = malloc(sizeof(*next) * cnt);
+  uint32_t bucket_cnt = 16;
+  while (bucket_cnt < 2 * (uint32_t)cnt) {
+    bucket_cnt *= 2;
+  }
+  int *bucket = malloc(sizeof(*bucket) * bucket_cnt);
+  memset(bucket, -1, sizeof(*bucket) * bucket_cnt);
+  int tiles = 0;
+  for (int pattern = 0; pattern < cnt; ++pattern) {
+    tile_of[pattern] = -1;
+    if (!alive[pattern]) {
+      continue;
+    }
+    uint32_t hash = overlap_rows_hash(res, pattern, alive);
+    int t;
+    for (t = bucket[hash & (bucket_cnt - 1)]; t != -1; t = next[t]) {
+      if (hashes[t] == hash && overlap_rows_equal(res, first[t], pattern, alive)) {
+        break;
+      }
+    }
+    if (t == -1) {
+      t = tiles++;
+      first[t] = pattern;
+      hashes[t] = hash;
+      next[t] = bucket[hash & (bucket_cnt - 1)];
+      bucket[hash & (bucket_cnt - 1)] = t;
+    }
+    tile_of[pattern] = t;
+  }
+  free(bucket);
+  free(next);
+  free(hashes);
+  /* members sorted by tile */
+  res->pattern_count = cnt;
+  res->member_first = calloc(tiles + 1, sizeof(*res->member_first));
+  res->members = malloc(sizeof(*res->members) * cnt);
+  res->member_weights = malloc(sizeof(*res->member_weights) * cnt);
+  for (int pattern = 0; pattern < cnt; ++pattern) {
+    if (tile_of[pattern] != -1) {
+      res->member_first[tile_of[pattern] + 1] += 1;
+    }
+  }
+  for (int t = 0; t < tiles; ++t) {
+    res->member_first[t + 1] += res->member_first[t];
+  }
+  int *fill = malloc(sizeof(*fill) * tiles);
+  memcpy(fill, res->member_first, sizeof(*fill) * tiles);
+  for (int pattern = 0; pattern < cnt; ++pattern) {
+    if (tile_of[pattern] != -1) {
+      res->member_weights[fill[tile_of[pattern]]] = res->weights[pattern];
+      res->members[fill[tile_of[pattern]]++] = pattern;
+    }
+  }
+  free(fill);
+  if (tiles == cnt) {
+    free(first);
+    free(tile_of);
+    free(alive);
+    return;
+  }
+  /* the tiles get the summed weight and the weighted colour of their
+   * patterns, the rows are rebuilt on tile ids */
+  float *weights = calloc(tiles, sizeof(*weights));
+  uint32_t *colours = malloc(sizeof(*colours) * tiles);
+  for (int t = 0; t < tiles; ++t) {
+    float sum[4] = {0};
+    for (int i = res->member_first[t]; i < res->member_first[t + 1]; ++i) {
+      weights[t] += res->member_weights[i];
+      for (int c = 0; c < 4; ++c) {
+        sum[c] += ((res->colours[res->members[i]] >> (24 - 8 * c)) & 0xff) * res->member_weights[i];
+      }
+    }
+    colours[t] = 0;
+    for (int c = 0; c < 4; ++c) {
+      colours[t] = (colours[t] << 8) | (uint32_t)(sum[c] / weights[t] + 0.5f);
     }
+    res->weight_log_weights[t] = weights[t] * logf(weights[t]);
   }
+  free(res->weights);
+  res->weights = weights;
+  free(res->colours);
+  res->colours = colours;
+  bitfield32_sparse *allowed_neighbours = malloc(sizeof(*allowed_neighbours) * 4 * tiles);
+  struct word_arena words = {0};
+  bitfield32 *allowed = calloc(1, sizeof(*allowed));
+  uint64_t *data = malloc(sizeof(*data) * BITFIELD_WORDS);
+  for (int dir = 0; dir < 4; ++dir) {
+    for (int t = 0; t < tiles; ++t) {
+      bitfield32_iter iter = bitfield32_get_iter(tile_get_allowed_neighbours(res, first[t], dir));
+      int id;
+      while (-1 != (id = bitfield32_iter_next(&iter))) {
+        if (tile_of[id] != -1) {
+          bitfield32_set_bit(allowed, tile_of[id]);
+        }
+      }
+      bitfield32_sparse *row = &allowed_neighbours[dir * tiles + t];
+      bitfield32_pack(allowed, row, data);
+      bitfield32_sparse_store(row, &words);
+      bitfield32_clear(allowed);
+    }
+  }
+  free(data);
+  free(allowed);
+  free(res->allowed_neighbours);
+  word_arena_free(&res->words);
+  res->allowed_neighbours = allowed_neighbours;
+  res->words = words;
+  res->tile_count = tiles;
+  free(first);
+  free(tile_of);
+  free(alive);
 }
 
+/* derived per tile data and the adjacency rows, called once all tiles are known */
+void overlap_analyse_tiles(struct analyse_result *res, int seamless)
+{
+  int cnt = res->tile_count;
+  res->weight_log_weights = malloc(sizeof(*res->weight_log_weights) * cnt);
+  res->colours = malloc(sizeof(*res->colours) * cnt);
+  res->rects = calloc(cnt, sizeof(*res->rects));
+  for (int tile = 0; tile < cnt; ++tile) {
+    res->weight_log_weights[tile] = res->weights[tile] * logf(res->weights[tile]);
+    res->colours[tile] = res->tiled ? tile_average_colour(res, tile) : res->palette[colour_get(tile_get_data(res, tile), res->pixel_words)];
+  }
+  /* rows are packed in direction major order, so the rows of one
+   * direction are next to each other in the arena */
+  res->allowed_neighbours = malloc(sizeof(*res->allowed_neighbours) * 4 * cnt);
+  bitfield32 *allowed = calloc(1, sizeof(*allowed));
+  uint64_t *data = malloc(sizeof(*data) * BITFIELD_WORDS);
+  if (res->tiled) {
+    tiled_build_adjacency(res, allowed, data);
+  } else {
+    overlap_build_adjacency(res, allowed, data);
+  }
+  free(data);
+  free(allowed);
+  overlap_minimize(res, seamless);
+}
 
 
-#define MAX_HISTORY 10000
-#define HISTORY_FLAG_IN_USE 1
-#define HISTORY_FLAG_SAVEPOINT 2
-typedef struct bitfield32_history_element_st bitfield32_history_element;
-struct bitfield32_history_element_st {
-  bitfield32_history_element *next;
-  bitfield32_history_element *prev;
-  int flags;
-  int x;
-  int y;
-  int id;
-  bitfield32 value;
+SDL_Renderer *glob_renderer = NULL;
+
+/* the input image or a rotated/mirrored copy of it. the window at (x, y)
+ * of the input is the window at (xx*x + xy*y + x0, yx*x + yy*y + y0) here,
+ * modulo the size, and holds the transformed pattern */
+struct pattern_source {
+  int w;
+  int h;
+  int words;                /* per pixel, see colour_get */
+  colour_index *pixels;
+  uint64_t *hashes;         /* hash of the window at every position */
+  int xx, xy, x0;
+  int yx, yy, y0;
 };
 
-typedef struct {
-  int pos;
-  int cnt;
-  int last_id;
-  bitfield32_history_element e[MAX_HISTORY];
-  bitfield32_history_element *first;
-  bitfield32_history_element *last;
-} bitfield32_history;
+static void pattern_source_window(struct pattern_source *src, int x, int y, int *out_x, int *out_y)
+{
+  *out_x = ((src->xx * x + src->xy * y + src->x0) % src->w + src->w) % src->w;
+  *out_y = ((src->yx * x + src->yy * y + src->y0) % src->h + src->h) % src->h;
+}
 
-#include <unistd.h>
+/* mirror left to right */
+static void pattern_source_mirror_v(struct pattern_source *src, int tile_size)
+{
+  int k = src->words;
+  for (int y = 0; y < src->h; ++y) {
+    colour_index *row = &src->pixels[y * src->w * k];
+    for (int x = 0; x < src->w / 2; ++x) {
+      for (int i = 0; i < k; ++i) {
+        colour_index c = row[x * k + i];
+        row[x * k + i] = row[(src->w - x - 1) * k + i];
+        row[(src->w - x - 1) * k + i] = c;
+      }
+    }
+  }
+  src->xx = -src->xx;
+  src->xy = -src->xy;
+  src->x0 = src->w - tile_size - src->x0;
+}
 
-int bitfield32_map_history_rollback(bitfield32_map *map, bitfield32_history *history)
+/* mirror top to bottom */
+static void pattern_source_mirror_h(struct pattern_source *src, int tile_size)
 {
-  int ret = -1;
-  while (history->last) {
-  //printf("->%d\n", history->cnt);
-    int has_flag = history->last->flags & HISTORY_FLAG_SAVEPOINT;
-    int x = history->last->x;
-    int y = history->last->y;
-    int id = history->last->id;
-    bitfield32 v = history->last->value;
-    history->last->flags = 0; /* reset flags */
-    history->cnt -= 1;
-    map->map[map->map_width * y + x] = v;
-    history->last = history->last->prev;
-    if (has_flag) {
-      history->last_id -= 1;
-      ret = id;
+  int row = src->w * src->words;
+  colour_index *c = malloc(sizeof(*c) * row);
+  for (int y = 0; y < src->h / 2; ++y) {
+    memcpy(c, &src->pixels[y * row], row * sizeof(*c));
+    memcpy(&src->pixels[y * row], &src->pixels[(src->h - y - 1) * row], row * sizeof(*c));
+    memcpy(&src->pixels[(src->h - y - 1) * row], c, row * sizeof(*c));
+  }
+  free(c);
+  src->yx = -src->yx;
+  src->yy = -src->yy;
+  src->y0 = src->h - tile_size - src->y0;
+}
+
+/* rotate clockwise */
+static void pattern_source_rotate90(struct pattern_source *src, int tile_size)
+{
+  int k = src->words;
+  colour_index *old = src->pixels;
+  src->pixels = malloc(sizeof(*src->pixels) * src->w * src->h * k);
+  for (int y = 0; y < src->h; ++y) {
+    for (int x = 0; x < src->w; ++x) {
+      memcpy(&src->pixels[(x * src->h + (src->h - y - 1)) * k], &old[(y * src->w + x) * k], k * sizeof(*old));
+    }
+  }
+  free(old);
+  int xx = src->xx;
+  int xy = src->xy;
+  int x0 = src->x0;
+  src->xx = -src->yx;
+  src->xy = -src->yy;
+  src->x0 = src->h - tile_size - src->y0;
+  src->yx = xx;
+  src->yy = xy;
+  src->y0 = x0;
+  int w = src->w;
+  src->w = src->h;
+  src->h = w;
+}
+
+/* polynomial hash of every tile_size window (wrapping around), rolled
+ * along the rows and then along the columns, O(pixels) for any tile_size */
+#define PATTERN_HASH_ROW 0x100000001b3ull
+#define PATTERN_HASH_COLUMN 0x9e3779b97f4a7c15ull
+static void pattern_source_hash(struct pattern_source *src, int tile_size)
+{
+  int w = src->w;
+  int h = src->h;
+  uint64_t row_pow = 1;
+  uint64_t column_pow = 1;
+  for (int i = 1; i < tile_size; ++i) {
+    row_pow *= PATTERN_HASH_ROW;
+    column_pow *= PATTERN_HASH_COLUMN;
+  }
+  uint64_t *rows = malloc(sizeof(*rows) * w * h);
+  int wrap_x = tile_size % w;
+  int k = src->words;
+  for (int y = 0; y < h; ++y) {
+    colour_index *p = &src->pixels[y * w * k];
+    uint64_t hash = 0;
+    for (int i = 0; i < tile_size; ++i) {
+      hash = hash * PATTERN_HASH_ROW + colour_get(&p[(i % w) * k], k);
+    }
+    for (int x = 0; x < w; ++x) {
+      int next = x + wrap_x < w ? x + wrap_x : x + wrap_x - w;
+      rows[y * w + x] = hash;
+      hash = (hash - colour_get(&p[x * k], k) * row_pow) * PATTERN_HASH_ROW + colour_get(&p[next * k], k);
+    }
+  }
+  src->hashes = realloc(src->hashes, sizeof(*src->hashes) * w * h);
+  uint64_t *column = calloc(w, sizeof(*column));
+  for (int i = 0; i < tile_size; ++i) {
+    uint64_t *r = &rows[(i % h) * w];
+    for (int x = 0; x < w; ++x) {
+      column[x] = column[x] * PATTERN_HASH_COLUMN + r[x];
+    }
+  }
+  for (int y = 0; y < h; ++y) {
+    uint64_t *first = &rows[y * w];
+    uint64_t *next = &rows[((y + tile_size) % h) * w];
+    uint64_t *out = &src->hashes[y * w];
+    for (int x = 0; x < w; ++x) {
+      out[x] = column[x];
+      column[x] = (column[x] - first[x] * column_pow) * PATTERN_HASH_COLUMN + next[x];
+    }
+  }
+  free(column);
+  free(rows);
+}
+
+#define ANALYZE_FLAG_NO_Y_WRAP 1
+#define ANALYZE_FLAG_NO_X_WRAP 2
+#define ANALYZE_FLAG_DO_MIRROR_V 4
+#define ANALYZE_FLAG_DO_MIRROR_H 8
+#define ANALYZE_FLAG_DO_ROTATE 16
+#define OUTPUT_FLAG_MAKE_SEAMLESS 32
+#define ANALYZE_FLAG_TILED 64
+/* the flags a ruleset depends on, seamless maps prune dead patterns */
+#define ANALYZE_FLAGS (ANALYZE_FLAG_NO_Y_WRAP | ANALYZE_FLAG_NO_X_WRAP | \
+    ANALYZE_FLAG_DO_MIRROR_V | ANALYZE_FLAG_DO_MIRROR_H | ANALYZE_FLAG_DO_ROTATE | \
+    ANALYZE_FLAG_TILED | OUTPUT_FLAG_MAKE_SEAMLESS)
+
+/* every scale * scale block becomes its most common colour */
+static void image_scale_down(colour_index *pixels, int *w, int *h, int scale, int colours, int words)
+{
+  int out_w = *w / scale;
+  int out_h = *h / scale;
+  int *count = calloc(colours, sizeof(*count));
+  for (int y = 0; y < out_h; ++y) {
+    for (int x = 0; x < out_w; ++x) {
+      uint32_t best = colour_get(&pixels[(y * scale * *w + x * scale) * words], words);
+      for (int by = 0; by < scale; ++by) {
+        for (int bx = 0; bx < scale; ++bx) {
+          uint32_t c = colour_get(&pixels[((y * scale + by) * *w + x * scale + bx) * words], words);
+          count[c] += 1;
+          if (count[c] > count[best] || (count[c] == count[best] && c < best)) {
+            best = c;
+          }
+        }
+      }
+      /* only the colours of the block are counted again */
+      for (int by = 0; by < scale; ++by) {
+        for (int bx = 0; bx < scale; ++bx) {
+          count[colour_get(&pixels[((y * scale + by) * *w + x * scale + bx) * words], words)] = 0;
+        }
+      }
+      /* the output row never overtakes the rows that are still read */
+      colour_put(&pixels[(y * out_w + x) * words], words, best);
+    }
+  }
+  free(count);
+  *w = out_w;
+  *h = out_h;
+}
+
+#define TILE_NONE 0xFFFFFFFFU
+
+/* the input scaled down by scale, see image_scale_down */
+struct analyse_result *overlap_analyse_scaled(char *name, int tile_size, int scale, int flags) {
+  struct analyse_result *ret = calloc(1, sizeof(*ret));
+  ret->tile_size = tile_size;
+  int surface_width;
+  int surface_height;
+  colour_index *pixels = load_indexed_image(name, ret, &surface_width, &surface_height);
+  if (!pixels) {
+    free(ret);
+    return NULL;
+  }
+  overlap_kernels_select(tile_size, ret->pixel_words);
+  if (scale > 1) {
+    /* the cut off pixels break the wrap around */
+    flags |= surface_width % scale ? ANALYZE_FLAG_NO_X_WRAP : 0;
+    flags |= surface_height % scale ? ANALYZE_FLAG_NO_Y_WRAP : 0;
+    image_scale_down(pixels, &surface_width, &surface_height, scale, ret->palette_count, ret->pixel_words);
+    if (surface_width < tile_size || surface_height < tile_size) {
+      free(pixels);
+      free(ret->palette);
+      free(ret);
+      return NULL;
+    }
+  }
+  /* the simple tiled model cuts the image into tiles instead of taking
+   * every window, the adjacency comes from the tile edges */
+  int step = 1;
+  if (flags & ANALYZE_FLAG_TILED) {
+    ret->tiled = 1;
+    step = tile_size;
+  }
+  int end_x = (ret->tiled || flags & ANALYZE_FLAG_NO_X_WRAP) ? surface_width - tile_size + 1 : surface_width;
+  int end_y = (ret->tiled || flags & ANALYZE_FLAG_NO_Y_WRAP) ? surface_height - tile_size + 1 : surface_height;
+  /* transformations of the image, one per symmetry: R rotates, V and H mirror */
+  char *variants[8];
+  int variant_cnt = 0;
+  variants[variant_cnt++] = "";
+  if (flags & ANALYZE_FLAG_DO_ROTATE) {
+    variants[variant_cnt++] = "R";
+    variants[variant_cnt++] = "RR";
+    variants[variant_cnt++] = "RRR";
+  }
+  if (flags & ANALYZE_FLAG_DO_ROTATE && flags & ANALYZE_FLAG_DO_MIRROR_H && flags & ANALYZE_FLAG_DO_MIRROR_V) {
+    variants[variant_cnt++] = "V";
+    variants[variant_cnt++] = "VR";
+    variants[variant_cnt++] = "VRR";
+    variants[variant_cnt++] = "VRRR";
+  } else {
+    if (flags & ANALYZE_FLAG_DO_MIRROR_V) {
+      variants[variant_cnt++] = "V";
+    }
+    if (flags & ANALYZE_FLAG_DO_MIRROR_H) {
+      variants[variant_cnt++] = "H";
+    }
+  }
+  struct tile_index index = {0};
+  struct pattern_source src = {0};
+  /* the pattern of every window of the untransformed image */
+  ret->map_width = (end_x + step - 1) / step;
+  ret->map_height = (end_y + step - 1) / step;
+  ret->map = malloc(sizeof(*ret->map) * ret->map_width * ret->map_height);
+  for (int v = 0; v < variant_cnt; ++v) {
+    src.w = surface_width;
+    src.h = surface_height;
+    src.words = ret->pixel_words;
+    src.pixels = realloc(src.pixels, sizeof(*src.pixels) * surface_width * surface_height * src.words);
+    memcpy(src.pixels, pixels, sizeof(*src.pixels) * surface_width * surface_height * src.words);
+    src.xx = 1;
+    src.xy = 0;
+    src.x0 = 0;
+    src.yx = 0;
+    src.yy = 1;
+    src.y0 = 0;
+    for (char *op = variants[v]; *op; ++op) {
+      if (*op == 'R') {
+        pattern_source_rotate90(&src, tile_size);
+      } else if (*op == 'V') {
+        pattern_source_mirror_v(&src, tile_size);
+      } else {
+        pattern_source_mirror_h(&src, tile_size);
+      }
+    }
+    pattern_source_hash(&src, tile_size);
+    /* a step along x moves the window by (dx, dy) in the source */
+    int dx;
+    int dy;
+    pattern_source_window(&src, step, 0, &dx, &dy);
+    dx = (dx - src.x0 % src.w + src.w) % src.w;
+    dy = (dy - src.y0 % src.h + src.h) % src.h;
+    for (int y = 0; y < end_y; y += step) {
+      int src_x;
+      int src_y;
+      pattern_source_window(&src, 0, y, &src_x, &src_y);
+      for (int x = 0; x < end_x; x += step) {
+        int pattern = overlap_add_tile_to_index2(ret, &index, src.hashes[src_y * src.w + src_x], src.pixels, src.w, src.h, src_x, src_y);
+        if (v == 0) {
+          ret->map[(y / step) * ret->map_width + x / step] = pattern;
+        }
+        src_x = src_x + dx < src.w ? src_x + dx : src_x + dx - src.w;
+        src_y = src_y + dy < src.h ? src_y + dy : src_y + dy - src.h;
+      }
+    }
+  }
+  free(src.pixels);
+  free(src.hashes);
+  free(index.slots);
+  free(pixels);
+  overlap_analyse_tiles(ret, flags & OUTPUT_FLAG_MAKE_SEAMLESS);
+  uint32_t hash = murmur3_32((uint8_t*)(uint32_t[]){tile_size, flags & ANALYZE_FLAGS}, 2 * sizeof(uint32_t), 0);
+  hash = murmur3_32((uint8_t*)ret->palette, sizeof(*ret->palette) * ret->palette_count, hash);
+  ret->ruleset_hash = murmur3_32((uint8_t*)ret->hashes, sizeof(*ret->hashes) * ret->pattern_count, hash);
+  /* patterns -> tiles, TILE_NONE for pruned patterns */
+  uint32_t *tile_of = malloc(sizeof(*tile_of) * ret->pattern_count);
+  memset(tile_of, 0xff, sizeof(*tile_of) * ret->pattern_count);
+  for (int t = 0; t < ret->tile_count; ++t) {
+    for (int i = ret->member_first[t]; i < ret->member_first[t + 1]; ++i) {
+      tile_of[ret->members[i]] = t;
+    }
+  }
+  for (uint32_t i = 0; i < ret->map_width * ret->map_height; ++i) {
+    ret->map[i] = tile_of[ret->map[i]];
+  }
+  free(tile_of);
+  uint32_t rmask = 0xff000000;
+  uint32_t gmask = 0x00ff0000;
+  uint32_t bmask = 0x0000ff00;
+  uint32_t amask = 0x000000ff;
+  int bpp = 0;
+  SDL_PixelFormatEnumToMasks (SDL_PIXELFORMAT_RGBA8888, &bpp, &rmask, &gmask, &bmask, &amask);
+  int surface_w = ceilf(sqrtf(ret->tile_count));
+  int surface_h = surface_w;
+  SDL_Surface *tmp_surface = SDL_CreateRGBSurface(0,
+      surface_w * ret->tile_size,
+      surface_h *  ret->tile_size,
+      32,
+      rmask, gmask, bmask, amask);
+  uint32_t *tile_rgba = malloc(sizeof(*tile_rgba) * ret->tile_size * ret->tile_size);
+  for (int i = 0; i < ret->tile_count; ++i) {
+    for (int p = 0; p < ret->tile_size * ret->tile_size; ++p) {
+      tile_rgba[p] = ret->palette[colour_get(&tile_get_data(ret, ret->members[ret->member_first[i]])[p * ret->pixel_words], ret->pixel_words)];
+    }
+    SDL_Surface *tile_surface =
+      SDL_CreateRGBSurfaceFrom(tile_rgba, ret->tile_size, ret->tile_size, 32, ret->tile_size * 4, rmask, gmask, bmask, amask);
+    int x = i % surface_w;
+    int y = i / surface_w;
+    SDL_Rect src_rect = {0, 0, ret->tile_size, ret->tile_size};
+    SDL_Rect dst_rect = {x * ret->tile_size, y * ret->tile_size, ret->tile_size, ret->tile_size};
+    SDL_BlitSurface(tile_surface, &src_rect, tmp_surface, &dst_rect);
+    SDL_FreeSurface(tile_surface);
+    ret->rects[i].x = x * ret->tile_size;
+    ret->rects[i].y = y * ret->tile_size;
+    ret->rects[i].w = 1;
+    ret->rects[i].h = 1;
+  }
+  free(tile_rgba);
+  ret->texture = SDL_CreateTextureFromSurface(glob_renderer, tmp_surface);
+  SDL_FreeSurface(tmp_surface);
+
+  return ret;
+}
+
+struct analyse_result *overlap_analyse_image(char *name, int tile_size, int flags) {
+  return overlap_analyse_scaled(name, tile_size, 1, flags);
+}
+
+
+void draw_rect(int x, int y, int w, int h, int r, int g, int b)
+{
+  SDL_Rect rect = {x, y, w, h};
+  SDL_SetRenderDrawColor(glob_renderer, r, g, b, 255);
+  SDL_RenderDrawRect(glob_renderer, &rect);
+  SDL_SetRenderDrawColor(glob_renderer, 0, 0, 0, 0);
+}
+
+
+void draw_tile(int x, int y, int tile_id, struct analyse_result *res)
+{
+  SDL_SetTextureBlendMode(res->texture, SDL_BLENDMODE_NONE);
+  SDL_Rect rect = {x, y, res->tile_size, res->tile_size};
+  SDL_RenderCopy(glob_renderer, res->texture, &res->rects[tile_id], &rect);
+}
+
+
+void draw_input_map(struct analyse_result *result)
+{
+  for(int y = 0; y < result->map_height; ++y) {
+    for (int x = 0; x < result->map_width; ++x) {
+      draw_tile(x * result->tile_size, y * result->tile_size, result->map[y * result->map_width + x], result);
+    }
+  }
+}
+
+/* interned cell states
+ *
+ * cells only store a state id, every distinct bitfield is stored once
+ * (packed, see bitfield32_sparse).
+ * the per-direction neighbour masks (union of allowed_neighbours of all
+ * tiles of a state) are cached per state and the binary-and of a state
+ * with a neighbour mask is memoized as a state transition.
+ */
+#define STATE_NONE 0xFFFFFFFFU
+#define STATE_CHUNK_BITS 10
+#define STATE_CHUNK_SIZE (1 << STATE_CHUNK_BITS)
+#define STATE_MAX_CHUNKS 4096
+#define STATE_RESET_COUNT (1 << 18)  /* a restart starts over above, see init_bitfield32_map_cells */
+
+typedef struct state_st {
+  bitfield32_sparse bits;   /* bitcount and entropy are always up to date */
+  uint32_t hash;
+  uint32_t next;            /* next state in hash bucket */
+  uint32_t neighbours[4];   /* interned neighbour mask per direction */
+  int has_colour;
+  uint32_t colour;          /* preview colour, see state_get_colour */
+} state;
+
+struct state_transition {
+  uint32_t a;
+  uint32_t b;
+  uint32_t result;
+};
+
+typedef struct state_table_st {
+  struct analyse_result *res;
+  uint32_t count;
+  state *chunks[STATE_MAX_CHUNKS];  /* chunks never move, state pointers stay valid */
+  struct word_arena words;  /* words of the states */
+  uint32_t *buckets;
+  uint32_t bucket_mask;
+  struct state_transition *transitions;
+  uint32_t transition_mask;
+  uint32_t transition_count;
+  uint32_t *tile_states;    /* the state of each single tile, STATE_NONE until interned */
+  pthread_mutex_t lock;     /* taken by parallel propagation workers */
+} state_table;
+
+static inline state *state_table_get(state_table *st, uint32_t id)
+{
+  return &st->chunks[id >> STATE_CHUNK_BITS][id & (STATE_CHUNK_SIZE - 1)];
+}
+
+static uint32_t state_hash(bitfield32_sparse *bits)
+{
+  uint32_t hash = murmur3_32((uint8_t*)bits->summary, sizeof(bits->summary), 4321);
+  return murmur3_32((uint8_t*)bits->data, sizeof(*bits->data) * bits->word_cnt, hash);
+}
+
+static void state_table_rehash(state_table *st, uint32_t bucket_cnt)
+{
+  free(st->buckets);
+  st->buckets = malloc(sizeof(*st->buckets) * bucket_cnt);
+  memset(st->buckets, 0xff, sizeof(*st->buckets) * bucket_cnt);
+  st->bucket_mask = bucket_cnt - 1;
+  for (uint32_t id = 0; id < st->count; ++id) {
+    state *s = state_table_get(st, id);
+    s->next = st->buckets[s->hash & st->bucket_mask];
+    st->buckets[s->hash & st->bucket_mask] = id;
+  }
+}
+
+state_table *state_table_create(struct analyse_result *res)
+{
+  state_table *st = calloc(1, sizeof(*st));
+  st->res = res;
+  pthread_mutex_init(&st->lock, NULL);
+  state_table_rehash(st, 1024);
+  st->transition_mask = 4096 - 1;
+  st->transitions = malloc(sizeof(*st->transitions) * (st->transition_mask + 1));
+  memset(st->transitions, 0xff, sizeof(*st->transitions) * (st->transition_mask + 1));
+  st->tile_states = malloc(sizeof(*st->tile_states) * res->tile_count);
+  memset(st->tile_states, 0xff, sizeof(*st->tile_states) * res->tile_count);
+  return st;
+}
+
+void state_table_free(state_table *st)
+{
+  for (int i = 0; i < STATE_MAX_CHUNKS && st->chunks[i]; ++i) {
+    free(st->chunks[i]);
+  }
+  word_arena_free(&st->words);
+  free(st->buckets);
+  free(st->transitions);
+  free(st->tile_states);
+  pthread_mutex_destroy(&st->lock);
+  free(st);
+}
+
+/* forgets all states but keeps their memory, the old ids become invalid */
+void state_table_reset(state_table *st)
+{
+  st->count = 0;
+  word_arena_rewind(&st->words);
+  memset(st->buckets, 0xff, sizeof(*st->buckets) * (st->bucket_mask + 1));
+  memset(st->transitions, 0xff, sizeof(*st->transitions) * (st->transition_mask + 1));
+  st->transition_count = 0;
+  memset(st->tile_states, 0xff, sizeof(*st->tile_states) * st->res->tile_count);
+}
+
+/* returns the id of the state with the same bits, adds it if needed */
+uint32_t state_table_intern_sparse(state_table *st, bitfield32_sparse *bits)
+{
+  uint32_t hash = state_hash(bits);
+  for (uint32_t id = st->buckets[hash & st->bucket_mask]; id != STATE_NONE; id = state_table_get(st, id)->next) {
+    state *s = state_table_get(st, id);
+    if (s->hash == hash && bitfield32_sparse_cmp(&s->bits, bits)) {
+      return id;
+    }
+  }
+  uint32_t id = st->count;
+  assert((id >> STATE_CHUNK_BITS) < STATE_MAX_CHUNKS);
+  if (!st->chunks[id >> STATE_CHUNK_BITS]) {
+    st->chunks[id >> STATE_CHUNK_BITS] = malloc(sizeof(state) * STATE_CHUNK_SIZE);
+  }
+  state *s = state_table_get(st, id);
+  s->bits = *bits;
+  bitfield32_sparse_store(&s->bits, &st->words);
+  s->bits.entropy = s->bits.bitcount > 1 ? get_entropy(&s->bits, st->res) : 0.0;
+  s->hash = hash;
+  for (int dir = 0; dir < 4; ++dir) {
+    s->neighbours[dir] = STATE_NONE;
+  }
+  s->has_colour = 0;
+  s->next = st->buckets[hash & st->bucket_mask];
+  st->buckets[hash & st->bucket_mask] = id;
+  st->count += 1;
+  if (st->count > st->bucket_mask) {
+    state_table_rehash(st, (st->bucket_mask + 1) * 2);
+  }
+  return id;
+}
+
+uint32_t state_table_intern(state_table *st, bitfield32 *bits)
+{
+  uint64_t data[BITFIELD_WORDS];
+  bitfield32_sparse packed;
+  bitfield32_pack(bits, &packed, data);
+  return state_table_intern_sparse(st, &packed);
+}
+
+/* state with all tiles set */
+uint32_t state_table_intern_all(state_table *st)
+{
+  bitfield32 bits = {0};
+  for(int b = 0; b < st->res->tile_count; ++b) {
+    bitfield32_set_bit(&bits, b);
+  }
+  return state_table_intern(st, &bits);
+}
+
+/* the state of a collapsed cell, interned once per tile */
+uint32_t state_table_intern_tile(state_table *st, int tile)
+{
+  if (st->tile_states[tile] == STATE_NONE) {
+    bitfield32 bits = {0};
+    bitfield32_set_bit(&bits, tile);
+    st->tile_states[tile] = state_table_intern(st, &bits);
+  }
+  return st->tile_states[tile];
+}
+
+/* union of the allowed neighbours in direction dir of all tiles in state id */
+uint32_t state_neighbour_mask(state_table *st, uint32_t id, int dir)
+{
+  state *s = state_table_get(st, id);
+  if (s->neighbours[dir] == STATE_NONE) {
+    int tile;
+    bitfield32 allowed_tiles = {0};
+    bitfield32_iter iter = bitfield32_get_iter(&s->bits);
+    while (-1 != (tile = bitfield32_iter_next(&iter))) {
+      bitfield32_or_sparse(&allowed_tiles, tile_get_allowed_neighbours(st->res, tile, dir));
+    }
+    uint32_t mask = state_table_intern(st, &allowed_tiles);
+    /* interning may have added a chunk but never moves s */
+    __atomic_store_n(&s->neighbours[dir], mask, __ATOMIC_RELEASE);
+  }
+  return s->neighbours[dir];
+}
+
+static uint32_t state_transition_slot(uint32_t a, uint32_t b)
+{
+  return murmur3_32((uint8_t*)(uint32_t[]){a, b}, 2 * sizeof(uint32_t), 99);
+}
+
+static void state_table_grow_transitions(state_table *st)
+{
+  struct state_transition *old = st->transitions;
+  uint32_t old_cnt = st->transition_mask + 1;
+  st->transition_mask = old_cnt * 2 - 1;
+  st->transitions = malloc(sizeof(*st->transitions) * (st->transition_mask + 1));
+  memset(st->transitions, 0xff, sizeof(*st->transitions) * (st->transition_mask + 1));
+  for (uint32_t i = 0; i < old_cnt; ++i) {
+    if (old[i].a != STATE_NONE) {
+      uint32_t slot = state_transition_slot(old[i].a, old[i].b) & st->transition_mask;
+      while (st->transitions[slot].a != STATE_NONE) {
+        slot = (slot + 1) & st->transition_mask;
+      }
+      st->transitions[slot] = old[i];
+    }
+  }
+  free(old);
+}
+
+/* memoized binary-and of two states */
+uint32_t state_and(state_table *st, uint32_t a, uint32_t b)
+{
+  if (a == b) {
+    return a;
+  }
+  uint32_t slot = state_transition_slot(a, b) & st->transition_mask;
+  while (st->transitions[slot].a != STATE_NONE) {
+    if (st->transitions[slot].a == a && st->transitions[slot].b == b) {
+      return st->transitions[slot].result;
+    }
+    slot = (slot + 1) & st->transition_mask;
+  }
+  uint64_t data[BITFIELD_WORDS];
+  bitfield32_sparse v;
+  bitfield32_sparse_and(&state_table_get(st, a)->bits, &state_table_get(st, b)->bits, &v, data);
+  uint32_t result = state_table_intern_sparse(st, &v);
+  st->transitions[slot].a = a;
+  st->transitions[slot].b = b;
+  st->transitions[slot].result = result;
+  st->transition_count += 1;
+  if (st->transition_count * 2 > st->transition_mask) {
+    state_table_grow_transitions(st);
+  }
+  return result;
+}
+
+struct row_best {
+  float key;                /* 0.0 if no open cell is left in the row */
+  int x;
+};
+
+/* the value of every cell before its first change in a wave */
+struct cell_undo {
+  uint32_t cnt;
+  uint32_t cap;
+  uint32_t *pos;
+  uint32_t *value;
+};
+
+typedef struct bitfield32_map bitfield32_map;
+typedef float (*cell_key_fn)(bitfield32_map *map, int x, int y, bitfield32_sparse *b);
+
+typedef struct bitfield32_map {
+  int map_width;
+  int map_height;
+  int block_shift;          /* cells are stored in blocks of 2^shift * 2^shift */
+  int morton;               /* z-order inside the blocks instead of row major */
+  int blocks_w;
+  uint32_t cell_count;      /* including the padding of the last blocks */
+  uint32_t *map;            /* state id per cell, see bitfield32_map_pos */
+  state_table *states;
+  char *file_name;          /* disk backed cells, see bitfield32_map_alloc */
+  int fd;
+  uint8_t *file;
+  size_t file_size;
+  int checkpointed;         /* the header states the cells, see bitfield32_map_checkpoint */
+  /* cell selection, see get_smalest */
+  uint8_t *row_dirty;       /* rows changed since the last selection/frame */
+  struct row_best *row_best;
+  cell_key_fn row_key;      /* key the row cache was built with */
+  int row_last;
+  int reopen_y;             /* topmost row reopened since the streams were updated */
+  int fixed_rows;           /* rows already streamed, they are never reopened */
+  float *noise;             /* tie-break noise per cell */
+  uint32_t *order;          /* spiral order of the cells */
+  int noise_ready;          /* noise/order are filled on the first selection */
+  int order_ready;
+  uint32_t cursor;          /* scanline/spiral position */
+  uint32_t *row_open;       /* not collapsed cells per row, see bitfield32_map_open_cells */
+  /* serial propagation, see propagate_stack */
+  uint32_t pattern_seed;    /* see bitfield32_map_pattern */
+  uint8_t *wave;            /* WAVE_QUEUED/WAVE_CHANGED per cell */
+  uint32_t *wave_changed;   /* cells changed in the current wave */
+  uint32_t wave_changed_cnt;
+  struct cell_undo *undo;   /* serial waves only, see coarse_guide_apply */
+  /* the arrays above (and the cells unless they are disk backed) are
+   * carved from one block, see bitfield32_map_carve */
+  uint8_t *arena;
+  size_t arena_size;
+} bitfield32_map;
+
+/* 0b1111 -> 0b01010101 */
+static inline uint32_t morton_spread(uint32_t v)
+{
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+static inline uint32_t morton_compact(uint32_t v)
+{
+  v &= 0x55555555;
+  v = (v | (v >> 1)) & 0x33333333;
+  v = (v | (v >> 2)) & 0x0f0f0f0f;
+  v = (v | (v >> 4)) & 0x00ff00ff;
+  v = (v | (v >> 8)) & 0x0000ffff;
+  return v;
+}
+
+/* index of cell x/y, row major for block_shift 0 */
+static inline uint32_t bitfield32_map_pos(bitfield32_map *map, int x, int y)
+{
+  int shift = map->block_shift;
+  int mask = (1 << shift) - 1;
+  uint32_t block = (y >> shift) * map->blocks_w + (x >> shift);
+  if (map->morton) {
+    return (block << (2 * shift)) | morton_spread(x & mask) | (morton_spread(y & mask) << 1);
+  }
+  return (block << (2 * shift)) | ((y & mask) << shift) | (x & mask);
+}
+
+static inline void bitfield32_map_xy(bitfield32_map *map, uint32_t pos, int *x, int *y)
+{
+  int shift = map->block_shift;
+  int mask = (1 << shift) - 1;
+  uint32_t block = pos >> (2 * shift);
+  uint32_t in_block = pos & ((1U << (2 * shift)) - 1);
+  if (map->morton) {
+    *x = ((block % map->blocks_w) << shift) | morton_compact(in_block);
+    *y = ((block / map->blocks_w) << shift) | morton_compact(in_block >> 1);
+    return;
+  }
+  *x = ((block % map->blocks_w) << shift) | (in_block & mask);
+  *y = ((block / map->blocks_w) << shift) | (in_block >> shift);
+}
+
+static inline state *bitfield32_map_get(bitfield32_map *map, int x, int y)
+{
+  return state_table_get(map->states, map->map[bitfield32_map_pos(map, x, y)]);
+}
+
+#define ROW_DIRTY_SELECTION 1
+#define ROW_DIRTY_PREVIEW 2
+#define ROW_DIRTY_PROGRESS 4
+#define ROW_DIRTY_ALL (ROW_DIRTY_SELECTION | ROW_DIRTY_PREVIEW | ROW_DIRTY_PROGRESS)
+
+/* marks row y for the selection and the preview, called for every changed cell */
+static inline void bitfield32_map_touch(bitfield32_map *map, int y)
+{
+  __atomic_store_n(&map->row_dirty[y], ROW_DIRTY_ALL, __ATOMIC_RELAXED);
+}
+
+float bitfield32_map_get_smales_entropy_noise_pos(bitfield32_map *map, int *out_x, int *out_y);
+float bitfield32_map_get_spiral_pos(bitfield32_map *map, int *out_x, int *out_y);
+extern float (*get_smalest)(bitfield32_map *map, int *out_x, int *out_y);
+
+static size_t arena_round(size_t size)
+{
+  return (size + 15) & ~(size_t)15;
+}
+
+static void *arena_take(uint8_t **pos, size_t size)
+{
+  void *ret = *pos;
+  *pos += arena_round(size);
+  return ret;
+}
+
+/* solver memory
+ *
+ * everything the solver needs per cell and per row is sized once for the
+ * map and placed in a single block. a restart of a map with the same size
+ * resets the block in place, so solving never allocates after the map has
+ * been created (the state table only grows while new states show up).
+ * noise and order are only reserved for the selection that uses them.
+ */
+static void bitfield32_map_carve(bitfield32_map *map, int with_cells)
+{
+  int need_noise = get_smalest == bitfield32_map_get_smales_entropy_noise_pos;
+  int need_order = get_smalest == bitfield32_map_get_spiral_pos;
+  size_t h = map->map_height;
+  size_t cells = map->cell_count;
+  size_t size = arena_round(h);
+  size += arena_round(sizeof(*map->row_best) * h);
+  size += arena_round(sizeof(*map->row_open) * h);
+  size += arena_round(sizeof(*map->wave) * cells);
+  size += arena_round(sizeof(*map->wave_changed) * cells);
+  size += need_noise ? arena_round(sizeof(*map->noise) * cells) : 0;
+  size += need_order ? arena_round(sizeof(*map->order) * cells) : 0;
+  size += with_cells ? sizeof(*map->map) * cells : 0;
+  if (size != map->arena_size) {
+    free(map->arena);
+    map->arena = malloc(size);
+    map->arena_size = size;
+  }
+  uint8_t *pos = map->arena;
+  map->row_dirty = arena_take(&pos, h);
+  map->row_best = arena_take(&pos, sizeof(*map->row_best) * h);
+  map->row_open = arena_take(&pos, sizeof(*map->row_open) * h);
+  map->wave = arena_take(&pos, sizeof(*map->wave) * cells);
+  map->wave_changed = arena_take(&pos, sizeof(*map->wave_changed) * cells);
+  map->noise = need_noise ? arena_take(&pos, sizeof(*map->noise) * cells) : NULL;
+  map->order = need_order ? arena_take(&pos, sizeof(*map->order) * cells) : NULL;
+  if (with_cells) {
+    map->map = arena_take(&pos, sizeof(*map->map) * cells);
+    memset(map->map, 0, sizeof(*map->map) * cells);
+  }
+}
+
+static void bitfield32_map_init_selection(bitfield32_map *map)
+{
+  memset(map->row_dirty, ROW_DIRTY_ALL, map->map_height);
+  memset(map->wave, 0, sizeof(*map->wave) * map->cell_count);
+  map->wave_changed_cnt = 0;
+  /* only drawn when a tile has several patterns, the solver gets the
+   * same random numbers otherwise */
+  struct analyse_result *res = map->states->res;
+  map->pattern_seed = res->member_first[res->tile_count] > res->tile_count ? rand() : 0;
+  map->noise_ready = 0;
+  map->order_ready = 0;
+  map->cursor = 0;
+  map->reopen_y = map->map_height;
+  map->fixed_rows = 0;
+}
+
+/* disk backed maps
+ *
+ * with a file name the cells are placed in a shared file mapping, so only
+ * the blocks that are being propagated have to stay resident. a checkpoint
+ * appends the interned states behind the cells and syncs the mapping, the
+ * stored ids are translated to a fresh state table on resume. the cells
+ * are updated in place, a checkpoint is only valid until solving goes on.
+ */
+#define MAP_FILE_MAGIC 0x4d434659 /* changes with the header */
+#define MAP_FILE_CELLS 4096     /* offset of the cells, the header gets a page */
+
+struct map_file_header {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t block_shift;
+  uint32_t tile_count;
+  uint32_t state_count;     /* states of the last checkpoint, 0 if solving went on */
+  uint64_t states_offset;
+  uint32_t morton;
+  uint32_t ruleset_hash;    /* a checkpoint of another ruleset is not resumed */
+};
+
+static void bitfield32_map_map_file(bitfield32_map *map)
+{
+  map->file_size = MAP_FILE_CELLS + sizeof(*map->map) * (size_t)map->cell_count;
+  map->file = mmap(NULL, map->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+  if (map->file == MAP_FAILED) {
+    perror(map->file_name);
+    exit(1);
+  }
+  map->map = (uint32_t *)(map->file + MAP_FILE_CELLS);
+}
+
+void bitfield32_map_free(bitfield32_map *map)
+{
+  if (map->file) {
+    munmap(map->file, map->file_size);
+    close(map->fd);
+    map->file = NULL;
+  }
+  free(map->arena);
+  map->arena = NULL;
+  map->arena_size = 0;
+  map->map = NULL;
+  map->row_dirty = NULL;
+  map->row_best = NULL;
+  map->row_open = NULL;
+  map->wave = NULL;
+  map->wave_changed = NULL;
+  map->noise = NULL;
+  map->order = NULL;
+}
+
+/* allocates the (empty) cells of a w * h map, a map of the same size is
+ * reset in place */
+void bitfield32_map_alloc(bitfield32_map *map, int w, int h)
+{
+  if (map->arena && map->map_width == w && map->map_height == h) {
+    if (map->file) {
+      /* the last checkpoint is gone with the cells */
+      ((struct map_file_header *)map->file)->state_count = 0;
+      map->checkpointed = 0;
+      memset(map->map, 0, sizeof(*map->map) * map->cell_count);
+    }
+    bitfield32_map_carve(map, !map->file);
+    bitfield32_map_init_selection(map);
+    return;
+  }
+  bitfield32_map_free(map);
+  int block = 1 << map->block_shift;
+  map->map_width = w;
+  map->map_height = h;
+  map->blocks_w = (w + block - 1) >> map->block_shift;
+  map->cell_count = (map->blocks_w * ((h + block - 1) >> map->block_shift)) << (2 * map->block_shift);
+  bitfield32_map_carve(map, !map->file_name);
+  bitfield32_map_init_selection(map);
+  if (!map->file_name) {
+    return;
+  }
+  map->fd = open(map->file_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (map->fd < 0 || ftruncate(map->fd, MAP_FILE_CELLS + sizeof(*map->map) * (size_t)map->cell_count)) {
+    perror(map->file_name);
+    exit(1);
+  }
+  bitfield32_map_map_file(map);
+  struct map_file_header *header = (struct map_file_header *)map->file;
+  header->magic = MAP_FILE_MAGIC;
+  header->width = w;
+  header->height = h;
+  header->block_shift = map->block_shift;
+  header->morton = map->morton;
+  header->tile_count = map->states->res->tile_count;
+  header->ruleset_hash = map->states->res->ruleset_hash;
+}
+
+/* stores the states of the cells and syncs the mapping */
+int bitfield32_map_checkpoint(bitfield32_map *map)
+{
+  if (!map->file) {
+    return -1;
+  }
+  state_table *st = map->states;
+  struct map_file_header *header = (struct map_file_header *)map->file;
+  /* per state: word count, summary and the stored words */
+  off_t offset = map->file_size;
+  for (uint32_t id = 0; id < st->count; ++id) {
+    bitfield32_sparse *bits = &state_table_get(st, id)->bits;
+    uint32_t cnt = bits->word_cnt;
+    if (pwrite(map->fd, &cnt, sizeof(cnt), offset) != sizeof(cnt) ||
+        pwrite(map->fd, bits->summary, sizeof(bits->summary), offset + sizeof(cnt)) != sizeof(bits->summary) ||
+        pwrite(map->fd, bits->data, sizeof(*bits->data) * cnt, offset + sizeof(cnt) + sizeof(bits->summary)) != sizeof(*bits->data) * cnt) {
+      return -1;
+    }
+    offset += sizeof(cnt) + sizeof(bits->summary) + sizeof(*bits->data) * cnt;
+  }
+  if (ftruncate(map->fd, offset) || fsync(map->fd)) {
+    return -1;
+  }
+  /* the header is written last, a torn checkpoint is never resumed */
+  msync(map->file, map->file_size, MS_SYNC);
+  header->states_offset = map->file_size;
+  header->state_count = st->count;
+  if (msync(map->file, MAP_FILE_CELLS, MS_SYNC)) {
+    return -1;
+  }
+  map->checkpointed = 1;
+  return 0;
+}
+
+/* the cells change in place after a checkpoint, it is dropped from the
+ * header before the first write so a crash never resumes mixed cells */
+void bitfield32_map_leave_checkpoint(bitfield32_map *map)
+{
+  if (!map->checkpointed) {
+    return;
+  }
+  ((struct map_file_header *)map->file)->state_count = 0;
+  msync(map->file, MAP_FILE_CELLS, MS_SYNC);
+  map->checkpointed = 0;
+}
+
+/* every stored cell refers to a stored state */
+static int map_file_cells_valid(int fd, uint32_t cell_count, uint32_t state_count)
+{
+  uint32_t *cells = malloc(sizeof(*cells) * 4096);
+  int ok = 1;
+  for (uint32_t pos = 0; ok && pos < cell_count; pos += 4096) {
+    uint32_t cnt = cell_count - pos < 4096 ? cell_count - pos : 4096;
+    ok = pread(fd, cells, sizeof(*cells) * cnt, MAP_FILE_CELLS + sizeof(*cells) * (off_t)pos) == sizeof(*cells) * cnt;
+    for (uint32_t i = 0; ok && i < cnt; ++i) {
+      ok = cells[i] < state_count;
+    }
+  }
+  free(cells);
+  return ok;
+}
+
+/* maps the cells of a checkpoint, returns 0 if there is none for this map */
+int bitfield32_map_resume(bitfield32_map *map, int w, int h, struct analyse_result *res)
+{
+  struct map_file_header header = {0};
+  if (!map->file_name) {
+    return 0;
+  }
+  int fd = open(map->file_name, O_RDWR);
+  if (fd < 0) {
+    return 0;
+  }
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != MAP_FILE_MAGIC ||
+      header.width != w || header.height != h || header.block_shift != map->block_shift || header.morton != map->morton ||
+      header.tile_count != res->tile_count || header.ruleset_hash != res->ruleset_hash || header.state_count == 0) {
+    close(fd);
+    return 0;
+  }
+  int block = 1 << map->block_shift;
+  uint32_t blocks_w = (w + block - 1) >> map->block_shift;
+  uint32_t cell_count = (blocks_w * ((h + block - 1) >> map->block_shift)) << (2 * map->block_shift);
+  if (!map_file_cells_valid(fd, cell_count, header.state_count)) {
+    printf("%s holds unknown states, not resumed\n", map->file_name);
+    close(fd);
+    return 0;
+  }
+  if (!map->states) {
+    map->states = state_table_create(res);
+  }
+  map->map_width = w;
+  map->map_height = h;
+  map->blocks_w = blocks_w;
+  map->cell_count = cell_count;
+  bitfield32_map_carve(map, 0);
+  bitfield32_map_init_selection(map);
+  map->fd = fd;
+  bitfield32_map_map_file(map);
+  /* stored id -> id in this state table */
+  uint32_t *ids = malloc(sizeof(*ids) * header.state_count);
+  bitfield32 *bits = calloc(1, sizeof(*bits));
+  uint64_t *data = malloc(sizeof(*data) * BITFIELD_WORDS);
+  off_t offset = header.states_offset;
+  for (uint32_t i = 0; i < header.state_count; ++i) {
+    uint32_t cnt = 0;
+    if (pread(fd, &cnt, sizeof(cnt), offset) != sizeof(cnt) || cnt > BITFIELD_WORDS ||
+        pread(fd, bits->summary, sizeof(bits->summary), offset + sizeof(cnt)) != sizeof(bits->summary) ||
+        pread(fd, data, sizeof(*data) * cnt, offset + sizeof(cnt) + sizeof(bits->summary)) != sizeof(*data) * cnt) {
+      perror(map->file_name);
+      exit(1);
+    }
+    offset += sizeof(cnt) + sizeof(bits->summary) + sizeof(*data) * cnt;
+    uint32_t pos = 0;
+    BITFIELD_FOREACH_WORD(bits->summary, w, {
+      bits->data[w] = pos < cnt ? data[pos] : 0;
+      pos += 1;
+    })
+    ids[i] = state_table_intern(map->states, bits);
+    bitfield32_clear(bits);
+  }
+  free(data);
+  free(bits);
+  for (uint32_t pos = 0; pos < map->cell_count; ++pos) {
+    map->map[pos] = ids[map->map[pos]];
+  }
+  free(ids);
+  /* the cells change in place from now on */
+  ((struct map_file_header *)map->file)->state_count = 0;
+  msync(map->file, MAP_FILE_CELLS, MS_SYNC);
+  printf("resumed %s (%u states)\n", map->file_name, map->states->count);
+  return 1;
+}
+
+void split_pixel(uint32_t pixel, uint8_t *r, uint8_t *g, uint8_t *b, uint8_t *a)
+{
+  *a = pixel & 0xff;
+  pixel >>= 8;
+  *b = pixel & 0xff;
+  pixel >>= 8;
+  *g = pixel & 0xff;
+  pixel >>= 8;
+  *r = pixel & 0xff;
+}
+
+uint32_t merge_pixel(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+  uint32_t ret = 0;
+  ret |= r;
+  ret <<= 8;
+  ret |= g;
+  ret <<= 8;
+  ret |= b;
+  ret <<= 8;
+  ret |= a;
+  return ret;
+}
+
+/* weighted colour of all tiles of a state, calculated once per state */
+uint32_t state_get_colour(state_table *st, uint32_t state_id)
+{
+  state *s = state_table_get(st, state_id);
+  if (s->has_colour) {
+    return s->colour;
+  }
+  struct analyse_result *res = st->res;
+  float sum = 0;
+  bitfield32_iter iter = bitfield32_get_iter(&s->bits);
+  int id;
+  while (-1 != (id = bitfield32_iter_next(&iter))) {
+    sum += res->weights[id];
+  }
+  float out_r = 0.5;
+  float out_g = 0.5;
+  float out_b = 0.5;
+  float out_a = 0.5;
+  iter = bitfield32_get_iter(&s->bits);
+  while (-1 != (id = bitfield32_iter_next(&iter))) {
+    float w = res->weights[id];
+    uint8_t tmp_r=0;
+    uint8_t tmp_g=0;
+    uint8_t tmp_b=0;
+    uint8_t tmp_a=0;
+    split_pixel(res->colours[id], &tmp_r, &tmp_g, &tmp_b, &tmp_a);
+    out_r += tmp_r * w / sum;
+    out_g += tmp_g * w / sum;
+    out_b += tmp_b * w / sum;
+    out_a += tmp_a * w / sum;
+  }
+  s->colour = merge_pixel(out_r, out_g, out_b, out_a);
+  __atomic_store_n(&s->has_colour, 1, __ATOMIC_RELEASE);
+  return s->colour;
+}
+
+void update_output_map(SDL_Surface *out, int x, int y, bitfield32_map *map, struct analyse_result *res)
+{
+  uint32_t *map_data = out->pixels;
+  map_data[y * out->w + x] = state_get_colour(map->states, map->map[bitfield32_map_pos(map, x, y)]);
+  bitfield32_map_touch(map, y);
+}
+
+/* weighted preview of every cell, composited into the output surface */
+void draw_map_with_weight(bitfield32_map *map, SDL_Surface *out)
+{
+  for (int y = 0; y < map->map_height; ++y) {
+    uint32_t *row = (uint32_t *)((uint8_t *)out->pixels + y * out->pitch);
+    for (int x = 0; x < map->map_width; ++x) {
+      row[x] = state_get_colour(map->states, map->map[bitfield32_map_pos(map, x, y)]);
+    }
+    bitfield32_map_touch(map, y);
+  }
+}
+
+/* uploads the rows changed since the last frame with one texture update */
+void update_output_texture(SDL_Texture *texture, SDL_Surface *out, bitfield32_map *map)
+{
+  int y0 = -1;
+  int y1 = 0;
+  for (int y = 0; y < map->map_height; ++y) {
+    if (map->row_dirty[y] & ROW_DIRTY_PREVIEW) {
+      map->row_dirty[y] &= ~ROW_DIRTY_PREVIEW;
+      if (y0 < 0) {
+        y0 = y;
+      }
+      y1 = y + 1;
+    }
+  }
+  if (y0 < 0) {
+    return;
+  }
+  SDL_Rect rect = {0, y0, out->w, y1 - y0};
+  SDL_UpdateTexture(texture, &rect, (uint8_t *)out->pixels + y0 * out->pitch, out->pitch);
+}
+
+/* cells that are not collapsed yet, only the rows changed since the last
+ * call are counted again */
+uint32_t bitfield32_map_open_cells(bitfield32_map *map)
+{
+  uint32_t open = 0;
+  for (int y = 0; y < map->map_height; ++y) {
+    if (map->row_dirty[y] & ROW_DIRTY_PROGRESS) {
+      map->row_dirty[y] &= ~ROW_DIRTY_PROGRESS;
+      map->row_open[y] = 0;
+      for (int x = 0; x < map->map_width; ++x) {
+        map->row_open[y] += bitfield32_map_get(map, x, y)->bits.bitcount != 1;
+      }
+    }
+    open += map->row_open[y];
+  }
+  return open;
+}
+
+#define MAX_HISTORY 10000
+#define HISTORY_FLAG_IN_USE 1
+#define HISTORY_FLAG_SAVEPOINT 2
+typedef struct bitfield32_history_element_st bitfield32_history_element;
+struct bitfield32_history_element_st {
+  bitfield32_history_element *next;
+  bitfield32_history_element *prev;
+  int flags;
+  int x;
+  int y;
+  int id;
+  uint32_t value;
+};
+
+typedef struct {
+  int pos;
+  int cnt;
+  int last_id;
+  bitfield32_history_element e[MAX_HISTORY];
+  bitfield32_history_element *first;
+  bitfield32_history_element *last;
+} bitfield32_history;
+
+#include <unistd.h>
+
+int bitfield32_map_history_rollback(bitfield32_map *map, bitfield32_history *history)
+{
+  int ret = -1;
+  while (history->last) {
+  //printf("->%d\n", history->cnt);
+    int has_flag = history->last->flags & HISTORY_FLAG_SAVEPOINT;
+    int x = history->last->x;
+    int y = history->last->y;
+    int id = history->last->id;
+    uint32_t v = history->last->value;
+    history->last->flags = 0; /* reset flags */
+    history->cnt -= 1;
+    map->map[bitfield32_map_pos(map, x, y)] = v;
+    bitfield32_map_touch(map, y);
+    history->last = history->last->prev;
+    if (has_flag) {
+      history->last_id -= 1;
+      ret = id;
+      break;
+    }
+  }
+  if (!history->last) {
+    history->first = NULL;
+  }
+  return ret;
+}
+
+int bitfield32_map_history_add(bitfield32_history *history, int x, int y, uint32_t value, int flags)
+{
+  bitfield32_history_element *e = NULL;
+  if (history->cnt == MAX_HISTORY) {
+    e = history->first;
+    history->first = e->next;
+    history->first->prev = NULL;
+    e->next = NULL;
+  } else {
+    history->cnt += 1;
+    //printf("-> ++ %d %d\n", history->cnt, flags);
+    while (!e) {
+      bitfield32_history_element *test =  &history->e[(history->pos ++)%MAX_HISTORY];
+      if (!(test->flags & HISTORY_FLAG_IN_USE)) {
+        e = test;
+      }
+    }
+  }
+  e->x = x;
+  e->y = y;
+  e->value = value;
+  e->flags = flags | HISTORY_FLAG_IN_USE;
+  if (flags & HISTORY_FLAG_SAVEPOINT) {
+    e->id = history->last_id ++;
+  }
+  e->prev = history->last;
+  if (history->last) {
+    history->last->next = e;
+  }
+  history->last = e;
+  if (!history->first) {
+    history->first = e;
+  }
+  return 0;
+}
+
+bitfield32_history glob_history = {0};
+int retry_cnt = 0;
+int last_id = 0;
+int rollback_cnt = 0;
+#define MAX_RETRIES 10
+
+/* this binary-ands map position x/y with value and update neighbours recursively */
+/* returns
+ * -1 tile out of range
+ *  0 nothing changed
+ *  1 value was modified
+ */
+
+struct error_condition {
+  int error;
+  int x;
+  int y;
+  int x0;
+  int y0;
+} glob_error_cond = {0};
+
+
+#define STACK_SIZE 10000
+struct update_stack_data {
+  int x;
+  int y;
+  int from_dir;
+};
+
+struct update_stack {
+  int start;
+  int cnt;
+  struct update_stack_data stack[STACK_SIZE];
+};
+
+struct update_stack glob_stack = {0};
+
+void push_stack(int x, int y, int from_dir)
+{
+  assert(glob_stack.cnt < STACK_SIZE);
+  int stack_pos = (glob_stack.start + glob_stack.cnt) % STACK_SIZE;
+  glob_stack.stack[stack_pos].x = x;
+  glob_stack.stack[stack_pos].y = y;
+  glob_stack.stack[stack_pos].from_dir = from_dir;
+  ++ glob_stack.cnt;
+}
+
+int pop_stack(int *x, int *y, int *from_dir)
+{
+  if (glob_stack.cnt <= 0) {
+    return 0;
+  }
+  *x = glob_stack.stack[glob_stack.start].x;
+  *y = glob_stack.stack[glob_stack.start].y;
+  *from_dir = glob_stack.stack[glob_stack.start].from_dir;
+  glob_stack.start = (glob_stack.start + 1) % STACK_SIZE;
+  -- glob_stack.cnt;
+  return 1;
+}
+
+void reset_stack(void)
+{
+  glob_stack.cnt = 0;
+  glob_stack.start = 0;
+}
+
+int update_map_with_rules(bitfield32_map *map, int x, int y, struct analyse_result *res, int from_dir, SDL_Surface *output_surface, int flags);
+int parallel_propagate(bitfield32_map *map, SDL_Surface *output_surface, int flags);
+
+struct parallel_propagator *glob_propagator = NULL;
+/* waves evaluating more cells are handed over to glob_propagator */
+#define PARALLEL_THRESHOLD 2048
+
+#include <time.h>
+
+static uint64_t now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* the serial propagator only marks cells during a wave: a cell is on
+ * glob_stack at most once and the preview/selection of a changed cell is
+ * updated once when the wave ends, see wave_flush. the neighbour masks,
+ * entropy and colours are memoized per state and computed on first use */
+#define WAVE_QUEUED 1
+#define WAVE_CHANGED 2
+
+/* wraps or clips x/y, returns 0 for cells outside of the map */
+static int wave_normalize(bitfield32_map *map, int *x, int *y, int flags)
+{
+  if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    *x = ((*x % map->map_width) + map->map_width) % map->map_width;
+    *y = ((*y % map->map_height) + map->map_height) % map->map_height;
+    return 1;
+  }
+  return *x >= 0 && *x < map->map_width && *y >= 0 && *y < map->map_height;
+}
+
+static void wave_push(bitfield32_map *map, int x, int y, int from_dir, int flags)
+{
+  if (!wave_normalize(map, &x, &y, flags)) {
+    return;
+  }
+  uint8_t *wave = &map->wave[bitfield32_map_pos(map, x, y)];
+  if (!(*wave & WAVE_QUEUED)) {
+    *wave |= WAVE_QUEUED;
+    push_stack(x, y, from_dir);
+  }
+}
+
+/* called before the cell at pos is changed */
+static void wave_changed(bitfield32_map *map, uint32_t pos)
+{
+  if (!(map->wave[pos] & WAVE_CHANGED)) {
+    map->wave[pos] |= WAVE_CHANGED;
+    map->wave_changed[map->wave_changed_cnt++] = pos;
+    struct cell_undo *undo = map->undo;
+    if (undo) {
+      if (undo->cnt == undo->cap) {
+        undo->cap = undo->cap ? undo->cap * 2 : 1024;
+        undo->pos = realloc(undo->pos, sizeof(*undo->pos) * undo->cap);
+        undo->value = realloc(undo->value, sizeof(*undo->value) * undo->cap);
+      }
+      undo->pos[undo->cnt] = pos;
+      undo->value[undo->cnt++] = map->map[pos];
+    }
+  }
+}
+
+static void wave_flush(bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface)
+{
+  for (uint32_t i = 0; i < map->wave_changed_cnt; ++i) {
+    int x;
+    int y;
+    map->wave[map->wave_changed[i]] &= ~WAVE_CHANGED;
+    bitfield32_map_xy(map, map->wave_changed[i], &x, &y);
+    update_output_map(output_surface, x, y, map, res);
+  }
+  map->wave_changed_cnt = 0;
+}
+
+/* clears the marks of the cells left on glob_stack, for waves that are
+ * handed over or given up */
+static void wave_drop(bitfield32_map *map)
+{
+  for (int i = 0; i < glob_stack.cnt; ++i) {
+    struct update_stack_data *e = &glob_stack.stack[(glob_stack.start + i) % STACK_SIZE];
+    map->wave[bitfield32_map_pos(map, e->x, e->y)] &= ~WAVE_QUEUED;
+  }
+}
+
+/* evaluates the cells on glob_stack until the wave is done
+ * returns
+ * -1 contradiction, see glob_error_cond
+ *  0 the wave is done
+ *  1 deadline (see now_us, 0 for none) reached, the rest of the wave
+ *    stays on glob_stack
+ * waves handed over to glob_propagator always run to the end
+ */
+int propagate_stack(bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags, uint64_t deadline)
+{
+  int evaluated = 0;
+  int x;
+  int y;
+  int from_dir;
+  while (pop_stack(&x, &y, &from_dir)) {
+    map->wave[bitfield32_map_pos(map, x, y)] &= ~WAVE_QUEUED;
+    evaluated += 1;
+    if (glob_propagator && evaluated > PARALLEL_THRESHOLD) {
+      push_stack(x, y, from_dir);
+      wave_drop(map);
+      wave_flush(map, res, output_surface);
+      return parallel_propagate(map, output_surface, flags);
+    }
+    if (deadline && (evaluated & 255) == 0 && now_us() >= deadline) {
+      map->wave[bitfield32_map_pos(map, x, y)] |= WAVE_QUEUED;
+      push_stack(x, y, from_dir);
+      wave_flush(map, res, output_surface);
+      return 1;
+    }
+    switch (update_map_with_rules(map, x, y, res, from_dir, output_surface, flags)) {
+      case -1:
+        /* ERROR condition */
+        glob_error_cond.x = x;
+        glob_error_cond.y = y;
+        glob_error_cond.error = 1;
+        printf("error condition\n");
+        wave_drop(map);
+        wave_flush(map, res, output_surface);
+        return -1;
+      case 0:
+        break;
+      case 1:
+        /* value changed push things to stack, this includes the
+         * neighbour we came from: it may have lost support */
+        for (int dir = 0 ; dir < 4; ++dir) {
+          wave_push(map, DIR_X(dir, x), DIR_Y(dir, y), OPOSITE_DIRECTION(dir), flags);
+        }
+        break;
+    }
+  }
+  wave_flush(map, res, output_surface);
+  return 0;
+}
+
+int update_recursive(bitfield32_map *map, int x, int y, struct analyse_result *res, int from_dir, SDL_Surface *output_surface, int flags)
+{
+  wave_push(map, x, y, from_dir, flags);
+  return propagate_stack(map, res, output_surface, flags, 0);
+}
+
+/* what's happening here?
+ *
+ */
+int update_map_with_rules(bitfield32_map *map, int x, int y, struct analyse_result *res, int from_dir, SDL_Surface *output_surface, int flags)
+{
+  /* wo dont evaluate any tiles that are out-of-map */
+  if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    /* normalize map (wrap) */
+    while (x < 0) {
+      x += map->map_width;
+    }
+    while (y < 0) {
+      y += map->map_height;
+    }
+    x %= map->map_width;
+    y %= map->map_height;
+  } else if (x < 0 || x >= map->map_width || y < 0 || y >= map->map_height) {
+    return 0;
+  }
+
+  uint32_t *map_element = &map->map[bitfield32_map_pos(map, x, y)];
+
+  /* collapsed tiles (bitcount == 1) are evaluated too: they either stay
+   * or become empty, which keeps the propagation order independent */
+  uint32_t new_value = *map_element;
+
+  for (int dir = 0; dir < 4; ++dir) {
+    int test_x = DIR_X(dir, x);
+    int test_y = DIR_Y(dir, y);
+    if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+      while (test_x < 0) {
+        test_x += map->map_width;
+      }
+      while (test_y < 0) {
+        test_y += map->map_height;
+      }
+      test_x %= map->map_width;
+      test_y %= map->map_height;
+    }
+    if (test_x >= 0 && test_x < map->map_width && test_y >= 0 && test_y < map->map_height) {
+      uint32_t mask = state_neighbour_mask(map->states, map->map[bitfield32_map_pos(map, test_x, test_y)], OPOSITE_DIRECTION(dir));
+      new_value = state_and(map->states, new_value, mask);
+    }
+  }
+  if (new_value != *map_element) {
+    /* add changed value to history */
+    //bitfield32_map_history_add(&glob_history, x, y, *map_element, 0);
+    wave_changed(map, map_element - map->map);
+    *map_element = new_value;
+    if (state_table_get(map->states, new_value)->bits.bitcount == 0) {
+#if 0
+      /* ERROR condition */
+      glob_error_cond.x = x;
+      glob_error_cond.y = y;
+      glob_error_cond.error = 1;
+      printf("error condition\n");
+#endif
+      return -1;
+    }
+#if 0
+    /* update neighbours */
+    for (int dir = 0; dir < 4; ++dir) {
+      if (dir == from_dir)
+        continue;
+      int test_x = DIR_X(dir, x);
+      int test_y = DIR_Y(dir, y);
+      if (-1 == update_map_with_rules(map, test_x, test_y, res, OPOSITE_DIRECTION(dir), output_surface, flags)) {
+        return -1;
+      }
+    }
+#endif
+    return 1;
+  }
+  return 0;
+}
+
+/* region-partitioned parallel propagation
+ *
+ * the map is split into horizontal bands, each owned by one worker. only
+ * the owner writes the cells of its band, updates of cells in a
+ * neighbouring band are sent through a single-producer/single-consumer
+ * inbox of that band. a cell is queued at most once at any time (queued
+ * flag), so a local queue never holds more cells than the band and an
+ * inbox never more than one row. arc consistency is confluent so the
+ * result is the same as with update_recursive.
+ */
+#define STATE_CACHE_SIZE 4096
+
+struct propagate_inbox {
+  uint32_t *data;
+  uint32_t size;
+  uint32_t head;            /* written by the owner */
+  uint32_t tail;            /* written by the neighbour band */
+};
+
+struct propagate_worker {
+  struct parallel_propagator *p;
+  int y0;                   /* owned rows y0 <= y < y1 */
+  int y1;
+  uint32_t *queue;
+  int queue_start;
+  int queue_cnt;
+  int queue_size;
+  struct propagate_inbox inbox[2];  /* from band above / from band below */
+  struct state_transition cache[STATE_CACHE_SIZE];
+  /* speculative observation: region queue and undo journal */
+  uint32_t *region_queue;
+  int region_queue_size;
+  struct observe_journal {
+    uint32_t pos;
+    uint32_t value;
+  } *journal;
+  int journal_cnt;
+  int journal_size;
+  int generation;
+  pthread_t thread;
+};
+
+struct parallel_propagator {
+  bitfield32_map *map;
+  SDL_Surface *output_surface;
+  int flags;
+  int thread_cnt;
+  int band_height;
+  struct propagate_worker *workers;
+  uint8_t *queued;
+  int pending;              /* busy workers + inbox entries */
+  int error;
+  int error_x;
+  int error_y;
+  pthread_mutex_t lock;
+  pthread_cond_t start_cond;
+  pthread_cond_t done_cond;
+  void (*job)(struct propagate_worker *w);  /* run by every worker per generation */
+  int generation;
+  int finished;
+  int quit;
+  /* speculative observation, see observe_batch */
+  int radius;
+  struct observe_job *observe_jobs;
+  int observe_job_cnt;
+  int observe_job_max;
+};
+
+static int propagate_owner(struct parallel_propagator *p, int y)
+{
+  int owner = y / p->band_height;
+  return owner < p->thread_cnt ? owner : p->thread_cnt - 1;
+}
+
+static uint32_t worker_neighbour_mask(struct propagate_worker *w, uint32_t id, int dir)
+{
+  state_table *st = w->p->map->states;
+  uint32_t mask = __atomic_load_n(&state_table_get(st, id)->neighbours[dir], __ATOMIC_ACQUIRE);
+  if (mask == STATE_NONE) {
+    pthread_mutex_lock(&st->lock);
+    mask = state_neighbour_mask(st, id, dir);
+    pthread_mutex_unlock(&st->lock);
+  }
+  return mask;
+}
+
+static uint32_t worker_state_and(struct propagate_worker *w, uint32_t a, uint32_t b)
+{
+  if (a == b) {
+    return a;
+  }
+  struct state_transition *c = &w->cache[state_transition_slot(a, b) & (STATE_CACHE_SIZE - 1)];
+  if (c->a != a || c->b != b) {
+    state_table *st = w->p->map->states;
+    pthread_mutex_lock(&st->lock);
+    c->result = state_and(st, a, b);
+    pthread_mutex_unlock(&st->lock);
+    c->a = a;
+    c->b = b;
+  }
+  return c->result;
+}
+
+static void worker_update_output(struct propagate_worker *w, int x, int y, uint32_t id)
+{
+  state_table *st = w->p->map->states;
+  state *s = state_table_get(st, id);
+  uint32_t colour;
+  if (__atomic_load_n(&s->has_colour, __ATOMIC_ACQUIRE)) {
+    colour = s->colour;
+  } else {
+    pthread_mutex_lock(&st->lock);
+    colour = state_get_colour(st, id);
+    pthread_mutex_unlock(&st->lock);
+  }
+  uint32_t *map_data = w->p->output_surface->pixels;
+  map_data[y * w->p->output_surface->w + x] = colour;
+  bitfield32_map_touch(w->p->map, y);
+}
+
+/* wraps or rejects coordinates, returns 0 for out-of-map positions */
+static int propagate_normalize(struct parallel_propagator *p, int *x, int *y)
+{
+  bitfield32_map *map = p->map;
+  if (p->flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    *x = (*x + map->map_width) % map->map_width;
+    *y = (*y + map->map_height) % map->map_height;
+    return 1;
+  }
+  return *x >= 0 && *x < map->map_width && *y >= 0 && *y < map->map_height;
+}
+
+static void worker_enqueue(struct propagate_worker *w, int x, int y, int dir)
+{
+  struct parallel_propagator *p = w->p;
+  uint32_t pos = bitfield32_map_pos(p->map, x, y);
+  if (__atomic_exchange_n(&p->queued[pos], 1, __ATOMIC_SEQ_CST)) {
+    /* already queued, the owner has not read the cell yet */
+    return;
+  }
+  struct propagate_worker *owner = &p->workers[propagate_owner(p, y)];
+  if (owner == w) {
+    assert(w->queue_cnt < w->queue_size);
+    w->queue[(w->queue_start + w->queue_cnt) % w->queue_size] = pos;
+    w->queue_cnt += 1;
+    return;
+  }
+  struct propagate_inbox *in = &owner->inbox[dir == BOTTOM ? 0 : 1];
+  __atomic_add_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+  uint32_t tail = in->tail;
+  assert(tail - __atomic_load_n(&in->head, __ATOMIC_ACQUIRE) < in->size);
+  in->data[tail % in->size] = pos;
+  __atomic_store_n(&in->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* moves inbox entries to the local queue, returns the number of moved cells */
+static int worker_take_inbox(struct propagate_worker *w)
+{
+  int moved = 0;
+  for (int i = 0; i < 2; ++i) {
+    struct propagate_inbox *in = &w->inbox[i];
+    uint32_t tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+    while (in->head != tail) {
+      w->queue[(w->queue_start + w->queue_cnt) % w->queue_size] = in->data[in->head % in->size];
+      w->queue_cnt += 1;
+      __atomic_store_n(&in->head, in->head + 1, __ATOMIC_RELEASE);
+      moved += 1;
+    }
+  }
+  return moved;
+}
+
+static int worker_inbox_empty(struct propagate_worker *w)
+{
+  return __atomic_load_n(&w->inbox[0].tail, __ATOMIC_ACQUIRE) == w->inbox[0].head &&
+    __atomic_load_n(&w->inbox[1].tail, __ATOMIC_ACQUIRE) == w->inbox[1].head;
+}
+
+/* value of cell x/y and-ed with the masks of its neighbours */
+static uint32_t worker_evaluate_cell(struct propagate_worker *w, int x, int y)
+{
+  bitfield32_map *map = w->p->map;
+  uint32_t value = map->map[bitfield32_map_pos(map, x, y)];
+  for (int dir = 0; dir < 4; ++dir) {
+    int test_x = DIR_X(dir, x);
+    int test_y = DIR_Y(dir, y);
+    if (propagate_normalize(w->p, &test_x, &test_y)) {
+      uint32_t neighbour = __atomic_load_n(&map->map[bitfield32_map_pos(map, test_x, test_y)], __ATOMIC_ACQUIRE);
+      value = worker_state_and(w, value, worker_neighbour_mask(w, neighbour, OPOSITE_DIRECTION(dir)));
+    }
+  }
+  return value;
+}
+
+/* parallel version of update_map_with_rules, followed by pushing the neighbours */
+static void worker_update_cell(struct propagate_worker *w, uint32_t pos)
+{
+  struct parallel_propagator *p = w->p;
+  bitfield32_map *map = p->map;
+  state_table *st = map->states;
+  int x;
+  int y;
+  bitfield32_map_xy(map, pos, &x, &y);
+  /* clear before reading the neighbours, later changes will queue the cell again */
+  __atomic_exchange_n(&p->queued[pos], 0, __ATOMIC_SEQ_CST);
+  uint32_t old_value = map->map[pos];
+  uint32_t new_value = worker_evaluate_cell(w, x, y);
+  if (new_value == old_value) {
+    return;
+  }
+  __atomic_store_n(&map->map[pos], new_value, __ATOMIC_RELEASE);
+  worker_update_output(w, x, y, new_value);
+  if (state_table_get(st, new_value)->bits.bitcount == 0) {
+    if (!__atomic_exchange_n(&p->error, 1, __ATOMIC_SEQ_CST)) {
+      p->error_x = x;
+      p->error_y = y;
+    }
+    return;
+  }
+  for (int dir = 0; dir < 4; ++dir) {
+    int test_x = DIR_X(dir, x);
+    int test_y = DIR_Y(dir, y);
+    if (propagate_normalize(p, &test_x, &test_y)) {
+      worker_enqueue(w, test_x, test_y, dir);
+    }
+  }
+}
+
+static void worker_drain(struct propagate_worker *w)
+{
+  struct parallel_propagator *p = w->p;
+  int busy = w->queue_cnt > 0;
+  for (;;) {
+    while (!__atomic_load_n(&p->error, __ATOMIC_RELAXED)) {
+      if (w->queue_cnt) {
+        uint32_t pos = w->queue[w->queue_start];
+        w->queue_start = (w->queue_start + 1) % w->queue_size;
+        w->queue_cnt -= 1;
+        worker_update_cell(w, pos);
+      } else {
+        if (!busy) {
+          /* a worker holding cells always counts in pending, before the
+           * messages it takes stop counting */
+          busy = 1;
+          __atomic_add_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+        }
+        int moved = worker_take_inbox(w);
+        if (!moved) {
+          break;
+        }
+        __atomic_sub_fetch(&p->pending, moved, __ATOMIC_SEQ_CST);
+      }
+    }
+    if (busy) {
+      busy = 0;
+      __atomic_sub_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    /* idle, wait for work from the neighbours or the end of the wave */
+    for (;;) {
+      if (!__atomic_load_n(&p->pending, __ATOMIC_SEQ_CST) || __atomic_load_n(&p->error, __ATOMIC_RELAXED)) {
+        return;
+      }
+      if (!worker_inbox_empty(w)) {
+        break;
+      }
+      sched_yield();
+    }
+    busy = 1;
+    __atomic_add_fetch(&p->pending, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void *propagate_worker_run(void *arg)
+{
+  struct propagate_worker *w = arg;
+  struct parallel_propagator *p = w->p;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (w->generation == p->generation && !p->quit) {
+      pthread_cond_wait(&p->start_cond, &p->lock);
+    }
+    if (p->quit) {
+      break;
+    }
+    w->generation = p->generation;
+    pthread_mutex_unlock(&p->lock);
+    p->job(w);
+    pthread_mutex_lock(&p->lock);
+    p->finished += 1;
+    if (p->finished == p->thread_cnt) {
+      pthread_cond_signal(&p->done_cond);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+struct parallel_propagator *parallel_propagator_create(bitfield32_map *map, SDL_Surface *output_surface, int flags, int thread_cnt)
+{
+  if (thread_cnt > map->map_height) {
+    thread_cnt = map->map_height;
+  }
+  if (thread_cnt < 2) {
+    return NULL;
+  }
+  struct parallel_propagator *p = calloc(1, sizeof(*p));
+  p->map = map;
+  p->output_surface = output_surface;
+  p->flags = flags;
+  p->thread_cnt = thread_cnt;
+  p->band_height = map->map_height / thread_cnt;
+  p->queued = calloc(1, map->cell_count);
+  p->workers = calloc(thread_cnt, sizeof(*p->workers));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start_cond, NULL);
+  pthread_cond_init(&p->done_cond, NULL);
+  for (int i = 0; i < thread_cnt; ++i) {
+    struct propagate_worker *w = &p->workers[i];
+    w->p = p;
+    w->y0 = i * p->band_height;
+    w->y1 = (i == thread_cnt - 1) ? map->map_height : w->y0 + p->band_height;
+    w->queue_size = (w->y1 - w->y0) * map->map_width;
+    w->queue = malloc(sizeof(*w->queue) * w->queue_size);
+    for (int in = 0; in < 2; ++in) {
+      w->inbox[in].size = map->map_width;
+      w->inbox[in].data = malloc(sizeof(*w->inbox[in].data) * map->map_width);
+    }
+    memset(w->cache, 0xff, sizeof(w->cache));
+    pthread_create(&w->thread, NULL, propagate_worker_run, w);
+  }
+  return p;
+}
+
+/* forgets the transitions memoized by the workers, the state ids are
+ * reused after state_table_reset. only called between waves */
+void parallel_propagator_reset_caches(struct parallel_propagator *p)
+{
+  for (int i = 0; i < p->thread_cnt; ++i) {
+    memset(p->workers[i].cache, 0xff, sizeof(p->workers[i].cache));
+  }
+}
+
+void parallel_propagator_free(struct parallel_propagator *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start_cond);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->thread_cnt; ++i) {
+    pthread_join(p->workers[i].thread, NULL);
+    free(p->workers[i].region_queue);
+    free(p->workers[i].journal);
+    free(p->workers[i].queue);
+    free(p->workers[i].inbox[0].data);
+    free(p->workers[i].inbox[1].data);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->start_cond);
+  pthread_cond_destroy(&p->done_cond);
+  free(p->observe_jobs);
+  free(p->workers);
+  free(p->queued);
+  free(p);
+}
+
+/* runs job on all workers and waits until all of them are done */
+static void parallel_run(struct parallel_propagator *p, void (*job)(struct propagate_worker *w))
+{
+  pthread_mutex_lock(&p->lock);
+  p->job = job;
+  p->finished = 0;
+  p->generation += 1;
+  pthread_cond_broadcast(&p->start_cond);
+  while (p->finished < p->thread_cnt) {
+    pthread_cond_wait(&p->done_cond, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* continues the wave left on glob_stack with glob_propagator */
+int parallel_propagate(bitfield32_map *map, SDL_Surface *output_surface, int flags)
+{
+  struct parallel_propagator *p = glob_propagator;
+  int x;
+  int y;
+  int from_dir;
+  p->pending = 0;
+  p->error = 0;
+  while (pop_stack(&x, &y, &from_dir)) {
+    if (!propagate_normalize(p, &x, &y)) {
+      continue;
+    }
+    uint32_t pos = bitfield32_map_pos(map, x, y);
+    if (p->queued[pos]) {
+      continue;
+    }
+    p->queued[pos] = 1;
+    struct propagate_worker *w = &p->workers[propagate_owner(p, y)];
+    w->queue[(w->queue_start + w->queue_cnt) % w->queue_size] = pos;
+    w->queue_cnt += 1;
+  }
+  for (int i = 0; i < p->thread_cnt; ++i) {
+    p->pending += p->workers[i].queue_cnt > 0;
+  }
+  parallel_run(p, worker_drain);
+  /* an error stops the wave early, drop what is left */
+  for (int i = 0; i < p->thread_cnt; ++i) {
+    struct propagate_worker *w = &p->workers[i];
+    w->queue_cnt = 0;
+    w->queue_start = 0;
+    w->inbox[0].head = w->inbox[0].tail;
+    w->inbox[1].head = w->inbox[1].tail;
+  }
+  if (p->error) {
+    memset(p->queued, 0, map->cell_count);
+    glob_error_cond.x = p->error_x;
+    glob_error_cond.y = p->error_y;
+    glob_error_cond.error = 1;
+    printf("error condition\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* speculative parallel observation
+ *
+ * a batch of low-entropy cells that are more than 2 * radius + 2 cells
+ * apart is collapsed at once, each worker propagates its cells only
+ * inside the square of the given radius around them. cells outside of all
+ * regions are never written during a batch, so a wave that would modify
+ * one is rolled back and the observation is redone sequentially.
+ */
+#define OBSERVE_JOBS_PER_THREAD 4
+
+struct observe_job {
+  int x;
+  int y;
+  int tile;
+  int failed;
+  float entropy;
+};
+
+static int observe_in_region(struct parallel_propagator *p, struct observe_job *job, int x, int y)
+{
+  int dx = abs(x - job->x);
+  int dy = abs(y - job->y);
+  if (p->flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    dx = dx < p->map->map_width - dx ? dx : p->map->map_width - dx;
+    dy = dy < p->map->map_height - dy ? dy : p->map->map_height - dy;
+  }
+  return dx <= p->radius && dy <= p->radius;
+}
+
+static void observe_set_cell(struct propagate_worker *w, uint32_t pos, uint32_t value)
+{
+  bitfield32_map *map = w->p->map;
+  if (w->journal_cnt == w->journal_size) {
+    w->journal_size = w->journal_size ? w->journal_size * 2 : 1024;
+    w->journal = realloc(w->journal, sizeof(*w->journal) * w->journal_size);
+  }
+  w->journal[w->journal_cnt].pos = pos;
+  w->journal[w->journal_cnt].value = map->map[pos];
+  w->journal_cnt += 1;
+  map->map[pos] = value;
+  int x;
+  int y;
+  bitfield32_map_xy(map, pos, &x, &y);
+  worker_update_output(w, x, y, value);
+}
+
+/* queues the neighbours of x/y, returns 0 if a cell outside of the region would change */
+static int observe_push_neighbours(struct propagate_worker *w, struct observe_job *job, int x, int y, int *queue_cnt)
+{
+  struct parallel_propagator *p = w->p;
+  for (int dir = 0; dir < 4; ++dir) {
+    int test_x = DIR_X(dir, x);
+    int test_y = DIR_Y(dir, y);
+    if (!propagate_normalize(p, &test_x, &test_y)) {
+      continue;
+    }
+    uint32_t pos = bitfield32_map_pos(p->map, test_x, test_y);
+    if (!observe_in_region(p, job, test_x, test_y)) {
+      if (worker_evaluate_cell(w, test_x, test_y) != p->map->map[pos]) {
+        return 0;
+      }
+    } else if (!p->queued[pos]) {
+      p->queued[pos] = 1;
+      w->region_queue[*queue_cnt] = pos;
+      *queue_cnt += 1;
+    }
+  }
+  return 1;
+}
+
+/* collapses job->x/y to job->tile and propagates inside its region */
+static int observe_cell(struct propagate_worker *w, struct observe_job *job)
+{
+  struct parallel_propagator *p = w->p;
+  bitfield32_map *map = p->map;
+  state_table *st = map->states;
+  int queue_cnt = 0;
+  int ok = 1;
+  w->journal_cnt = 0;
+  pthread_mutex_lock(&st->lock);
+  uint32_t value = state_table_intern_tile(st, job->tile);
+  pthread_mutex_unlock(&st->lock);
+  observe_set_cell(w, bitfield32_map_pos(map, job->x, job->y), value);
+  ok = observe_push_neighbours(w, job, job->x, job->y, &queue_cnt);
+  /* the region queue is used as a stack, every cell is queued at most once */
+  while (ok && queue_cnt) {
+    uint32_t pos = w->region_queue[--queue_cnt];
+    int x;
+    int y;
+    bitfield32_map_xy(map, pos, &x, &y);
+    p->queued[pos] = 0;
+    value = worker_evaluate_cell(w, x, y);
+    if (value == map->map[pos]) {
+      continue;
+    }
+    observe_set_cell(w, pos, value);
+    ok = state_table_get(st, value)->bits.bitcount && observe_push_neighbours(w, job, x, y, &queue_cnt);
+  }
+  if (!ok) {
+    while (queue_cnt) {
+      p->queued[w->region_queue[--queue_cnt]] = 0;
+    }
+    while (w->journal_cnt) {
+      struct observe_journal *j = &w->journal[--w->journal_cnt];
+      int x;
+      int y;
+      map->map[j->pos] = j->value;
+      bitfield32_map_xy(map, j->pos, &x, &y);
+      worker_update_output(w, x, y, j->value);
+    }
+  }
+  return ok;
+}
+
+static void worker_observe(struct propagate_worker *w)
+{
+  struct parallel_propagator *p = w->p;
+  for (int i = w - p->workers; i < p->observe_job_cnt; i += p->thread_cnt) {
+    p->observe_jobs[i].failed = !observe_cell(w, &p->observe_jobs[i]);
+  }
+}
+
+static int observe_job_cmp(const void *a, const void *b)
+{
+  float ea = ((const struct observe_job *)a)->entropy;
+  float eb = ((const struct observe_job *)b)->entropy;
+  return (ea > eb) - (ea < eb);
+}
+
+void parallel_propagator_set_radius(struct parallel_propagator *p, int radius)
+{
+  int side = 2 * radius + 1;
+  p->radius = radius;
+  for (int i = 0; i < p->thread_cnt; ++i) {
+    struct propagate_worker *w = &p->workers[i];
+    w->region_queue_size = side * side;
+    w->region_queue = realloc(w->region_queue, sizeof(*w->region_queue) * w->region_queue_size);
+  }
+}
+
+/* observes a batch of distant cells, returns the number of observed cells */
+int observe_batch(bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  static int parity = 0;
+  struct parallel_propagator *p = glob_propagator;
+  /* the lowest entropy cell per sector, sectors of one parity never touch.
+   * only cells that are already constrained are taken, independent seeds
+   * in untouched areas tend to contradict each other where they meet */
+  int sector = 2 * p->radius + 2;
+  int sectors_w = (map->map_width + sector - 1) / sector;
+  int sectors_h = (map->map_height + sector - 1) / sector;
+  if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    /* only full sectors, an even number of them keeps the first and the
+     * last sector of one parity apart across the wrap */
+    sectors_w = (map->map_width / sector) & ~1;
+    sectors_h = (map->map_height / sector) & ~1;
+  }
+  int max_jobs = p->thread_cnt * OBSERVE_JOBS_PER_THREAD;
+  int job_cnt = 0;
+  int px = parity & 1;
+  int py = (parity >> 1) & 1;
+  parity += 1;
+  int job_max = (sectors_w / 2 + 1) * (sectors_h / 2 + 1);
+  if (p->observe_job_max < job_max) {
+    p->observe_jobs = realloc(p->observe_jobs, sizeof(*p->observe_jobs) * job_max);
+    p->observe_job_max = job_max;
+  }
+  for (int sy = py; sy < sectors_h; sy += 2) {
+    for (int sx = px; sx < sectors_w; sx += 2) {
+      struct observe_job *job = &p->observe_jobs[job_cnt];
+      job->entropy = 0.0;
+      for (int y = sy * sector; y < (sy + 1) * sector && y < map->map_height; ++y) {
+        for (int x = sx * sector; x < (sx + 1) * sector && x < map->map_width; ++x) {
+          bitfield32_sparse *b = &bitfield32_map_get(map, x, y)->bits;
+          if (b->bitcount > 1 && b->bitcount < res->tile_count && (job->entropy == 0.0 || b->entropy < job->entropy)) {
+            job->x = x;
+            job->y = y;
+            job->entropy = b->entropy;
+          }
+        }
+      }
+      job_cnt += job->entropy != 0.0;
+    }
+  }
+  if (job_cnt < 2) {
+    return 0;
+  }
+  qsort(p->observe_jobs, job_cnt, sizeof(*p->observe_jobs), observe_job_cmp);
+  if (job_cnt > max_jobs) {
+    job_cnt = max_jobs;
+  }
+  for (int i = 0; i < job_cnt; ++i) {
+    struct observe_job *job = &p->observe_jobs[i];
+    job->tile = select_tile_based_on_weight(&bitfield32_map_get(map, job->x, job->y)->bits, res);
+  }
+  p->observe_job_cnt = job_cnt;
+  parallel_run(p, worker_observe);
+  /* redo rolled back observations sequentially, earlier redos may have
+   * changed the cell */
+  for (int i = 0; i < job_cnt; ++i) {
+    struct observe_job *job = &p->observe_jobs[i];
+    bitfield32_sparse *b = &bitfield32_map_get(map, job->x, job->y)->bits;
+    if (!job->failed || b->bitcount <= 1) {
+      continue;
+    }
+    if (!bitfield32_sparse_get_bit(b, job->tile)) {
+      job->tile = select_tile_based_on_weight(b, res);
+    }
+    map->map[bitfield32_map_pos(map, job->x, job->y)] = state_table_intern_tile(map->states, job->tile);
+    update_output_map(output_surface, job->x, job->y, map, res);
+    for (int dir = 0; dir < 4; ++dir) {
+      if (-1 == update_recursive(map, DIR_X(dir, job->x), DIR_Y(dir, job->y), res, OPOSITE_DIRECTION(dir), output_surface, flags)) {
+        return i + 1;
+      }
+    }
+  }
+  return job_cnt;
+}
+
+/* initial arc-consistent state
+ *
+ * every cell starts with the same state, so after k synchronous update
+ * rounds a cell only depends on its distances to the map borders clipped
+ * at k. the fixpoint is calculated on a small (2d+1)x(2d+1) profile map;
+ * when it is reached within d rounds the interior rows/columns of the
+ * profile are stretched to the full map. seamless maps have no borders,
+ * so all cells share one state.
+ */
+static int init_profile_pos(int pos, int size, int profile_size, int d)
+{
+  if (profile_size == size || pos < d) {
+    return pos;
+  }
+  if (pos > size - 1 - d) {
+    return 2 * d - (size - 1 - pos);
+  }
+  return d;
+}
+
+static int init_profile_round(state_table *st, uint32_t *profile, uint32_t *tmp, int w, int h, int flags)
+{
+  int changed = 0;
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      uint32_t v = profile[y * w + x];
+      for (int dir = 0; dir < 4; ++dir) {
+        int test_x = DIR_X(dir, x);
+        int test_y = DIR_Y(dir, y);
+        if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+          test_x = (test_x + w) % w;
+          test_y = (test_y + h) % h;
+        } else if (test_x < 0 || test_x >= w || test_y < 0 || test_y >= h) {
+          continue;
+        }
+        v = state_and(st, v, state_neighbour_mask(st, profile[test_y * w + test_x], OPOSITE_DIRECTION(dir)));
+      }
+      changed |= (v != profile[y * w + x]);
+      tmp[y * w + x] = v;
+    }
+  }
+  memcpy(profile, tmp, sizeof(*profile) * w * h);
+  return changed;
+}
+
+/* all cells narrowed by their distance to the border, see init_bitfield32_map */
+static void init_bitfield32_map_cells(bitfield32_map *map, int w, int h, struct analyse_result *res, int flags)
+{
+  if (!map->states) {
+    map->states = state_table_create(res);
+  }
+  bitfield32_map_alloc(map, w, h);
+  if (map->states->count > STATE_RESET_COUNT) {
+    /* the cells are refilled anyway, keeps repeated restarts from
+     * running out of state ids */
+    state_table_reset(map->states);
+    if (glob_propagator && glob_propagator->map == map) {
+      parallel_propagator_reset_caches(glob_propagator);
+    }
+  }
+  /* fill with all possibilities */
+  printf("initialize bitfield\n");
+  uint32_t all = state_table_intern_all(map->states);
+
+  printf("initial update\n");
+  int d = 8;
+  int profile_w;
+  int profile_h;
+  uint32_t *profile = NULL;
+  for (;;) {
+    profile_w = (flags & OUTPUT_FLAG_MAKE_SEAMLESS) ? 1 : (w < 2 * d + 1 ? w : 2 * d + 1);
+    profile_h = (flags & OUTPUT_FLAG_MAKE_SEAMLESS) ? 1 : (h < 2 * d + 1 ? h : 2 * d + 1);
+    profile = realloc(profile, sizeof(*profile) * profile_w * profile_h * 2);
+    uint32_t *tmp = &profile[profile_w * profile_h];
+    for (int i = 0; i < profile_w * profile_h; ++i) {
+      profile[i] = all;
+    }
+    int rounds = 0;
+    while (init_profile_round(map->states, profile, tmp, profile_w, profile_h, flags)) {
+      rounds += 1;
+    }
+    if (rounds < d || (profile_w == w && profile_h == h) || (flags & OUTPUT_FLAG_MAKE_SEAMLESS)) {
+      break;
+    }
+    d *= 2;
+  }
+  if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    /* every cell maps to the single profile cell */
+    d = 0;
+  }
+  for (int i = 0; i < profile_w * profile_h; ++i) {
+    if (state_table_get(map->states, profile[i])->bits.bitcount == 0) {
+      /* no single cell to restart from */
+      glob_error_cond.x = -1;
+      glob_error_cond.y = -1;
+      glob_error_cond.error = 1;
+      printf("error\n");
+      free(profile);
+      return;
+    }
+  }
+  /* stretch profile */
+  for (int y = 0; y < h; ++y) {
+    uint32_t *profile_row = &profile[init_profile_pos(y, h, profile_h, d) * profile_w];
+    for (int x = 0; x < w; ++x) {
+      map->map[bitfield32_map_pos(map, x, y)] = profile_row[init_profile_pos(x, w, profile_w, d)];
+    }
+  }
+  free(profile);
+  printf("done (%u states)\n", map->states->count);
+}
+
+/* cell selection
+ *
+ * get_smalest returns the next cell to observe. the minimum searches keep
+ * the best open cell of every row and only rescan the rows that changed
+ * since the last call, scanline and spiral order move a cursor that never
+ * goes back (reopened regions are solved before get_smalest is asked).
+ */
+static float cell_key_entropy(bitfield32_map *map, int x, int y, bitfield32_sparse *b)
+{
+  return b->entropy;
+}
+
+static float cell_key_entropy_noise(bitfield32_map *map, int x, int y, bitfield32_sparse *b)
+{
+  return b->entropy + map->noise[bitfield32_map_pos(map, x, y)];
+}
+
+static float cell_key_bitcount(bitfield32_map *map, int x, int y, bitfield32_sparse *b)
+{
+  return b->bitcount;
+}
+
+/* smallest key of all open cells, the last one of equal keys if last is set */
+static float select_min_by_row(bitfield32_map *map, cell_key_fn key, int last, int *out_x, int *out_y)
+{
+  if (map->row_key != key || map->row_last != last) {
+    map->row_key = key;
+    map->row_last = last;
+    for (int y = 0; y < map->map_height; ++y) {
+      map->row_dirty[y] |= ROW_DIRTY_SELECTION;
+    }
+  }
+  float smalest = 0.0;
+  for (int y = 0; y <  map->map_height; ++y) {
+    struct row_best *row = &map->row_best[y];
+    if (map->row_dirty[y] & ROW_DIRTY_SELECTION) {
+      map->row_dirty[y] &= ~ROW_DIRTY_SELECTION;
+      row->key = 0.0;
+      for (int x = 0; x < map->map_width; ++x) {
+        bitfield32_sparse *b = &bitfield32_map_get(map, x, y)->bits;
+        if (b->bitcount > 1) {
+          float k = key(map, x, y, b);
+          if (row->key == 0.0 || k < row->key || (last && k == row->key)) {
+            row->key = k;
+            row->x = x;
+          }
+        }
+      }
+    }
+    if (row->key != 0.0 && (smalest == 0.0 || row->key < smalest || (last && row->key == smalest))) {
+      *out_x = row->x;
+      *out_y = y;
+      smalest = row->key;
+    }
+  }
+  return smalest;
+}
+
+float bitfield32_map_get_smales_entropy_pos_last(bitfield32_map *map, int *out_x, int *out_y)
+{
+  return select_min_by_row(map, cell_key_entropy, 1, out_x, out_y);
+}
+
+float bitfield32_map_get_smales_entropy_pos(bitfield32_map *map, int *out_x, int *out_y)
+{
+  return select_min_by_row(map, cell_key_entropy, 0, out_x, out_y);
+}
+
+/* minimum entropy, ties are broken by a fixed random offset per cell */
+float bitfield32_map_get_smales_entropy_noise_pos(bitfield32_map *map, int *out_x, int *out_y)
+{
+  if (!map->noise_ready) {
+    map->noise_ready = 1;
+    for (uint32_t pos = 0; pos < map->cell_count; ++pos) {
+      map->noise[pos] = my_random() * 1e-4;
+    }
+  }
+  return select_min_by_row(map, cell_key_entropy_noise, 0, out_x, out_y);
+}
+
+/* minimum remaining values */
+float bitfield32_map_get_smales_bitcount_pos(bitfield32_map *map, int *out_x, int *out_y)
+{
+  return select_min_by_row(map, cell_key_bitcount, 0, out_x, out_y);
+}
+
+/* first open cell in the order, the cursor skips collapsed cells for good */
+static float select_in_order(bitfield32_map *map, int *out_x, int *out_y)
+{
+  uint32_t cnt = map->map_width * map->map_height;
+  for (; map->cursor < cnt; ++map->cursor) {
+    int x;
+    int y;
+    if (map->order_ready) {
+      bitfield32_map_xy(map, map->order[map->cursor], &x, &y);
+    } else {
+      x = map->cursor % map->map_width;
+      y = map->cursor / map->map_width;
+    }
+    bitfield32_sparse *b = &bitfield32_map_get(map, x, y)->bits;
+    if (b->bitcount > 1) {
+      *out_x = x;
+      *out_y = y;
+      return b->entropy;
+    }
+  }
+  return 0.0;
+}
+
+float bitfield32_map_get_scanline_pos(bitfield32_map *map, int *out_x, int *out_y)
+{
+  return select_in_order(map, out_x, out_y);
+}
+
+/* rings around the center of the map */
+float bitfield32_map_get_spiral_pos(bitfield32_map *map, int *out_x, int *out_y)
+{
+  if (!map->order_ready) {
+    int w = map->map_width;
+    int h = map->map_height;
+    int cx = w / 2;
+    int cy = h / 2;
+    uint32_t cnt = 0;
+    map->order_ready = 1;
+    for (int r = 0; cnt < (uint32_t)(w * h); ++r) {
+      /* walk the ring clockwise, starting at its top left corner */
+      int x = cx - r;
+      int y = cy - r;
+      int steps = r ? 8 * r : 1;
+      for (int i = 0; i < steps; ++i) {
+        if (x >= 0 && x < w && y >= 0 && y < h) {
+          map->order[cnt++] = bitfield32_map_pos(map, x, y);
+        }
+        int side = r ? i / (2 * r) : 0;
+        x += (side == 0) - (side == 2);
+        y += (side == 1) - (side == 3);
+      }
+    }
+  }
+  return select_in_order(map, out_x, out_y);
+}
+
+float (*get_smalest)(bitfield32_map *map, int *out_x, int *out_y) = bitfield32_map_get_smales_entropy_pos;
+
+
+/* local re-generation
+ *
+ * a region is a list of cells that are reset to all possibilities and
+ * narrowed again by their (fixed) surroundings. while a region is active
+ * only its cells are observed, so the cost of an edit depends on the size
+ * of the region and not on the size of the map.
+ */
+struct region {
+  int active;               /* set by region_reopen until all cells are collapsed */
+  int cnt;
+  int cap;
+  uint32_t *cells;          /* see bitfield32_map_pos */
+};
+
+struct region glob_region = {0};
+
+/* room for every cell of the map, only grows with the map */
+static void region_reserve(struct region *r, bitfield32_map *map)
+{
+  int cnt = map->map_width * map->map_height;
+  if (r->cap < cnt) {
+    r->cells = realloc(r->cells, sizeof(*r->cells) * cnt);
+    r->cap = cnt;
+  }
+}
+
+/* the rectangle is clipped to the map, seamless maps wrap it around */
+void region_set_rect(struct region *r, bitfield32_map *map, int x, int y, int w, int h, int flags)
+{
+  r->cnt = 0;
+  region_reserve(r, map);
+  if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+    w = w < map->map_width ? w : map->map_width;
+    h = h < map->map_height ? h : map->map_height;
+  }
+  for (int ry = y; ry < y + h; ++ry) {
+    for (int rx = x; rx < x + w; ++rx) {
+      if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
+        r->cells[r->cnt++] = bitfield32_map_pos(map,
+            ((rx % map->map_width) + map->map_width) % map->map_width,
+            ((ry % map->map_height) + map->map_height) % map->map_height);
+      } else if (rx >= 0 && rx < map->map_width && ry >= 0 && ry < map->map_height) {
+        r->cells[r->cnt++] = bitfield32_map_pos(map, rx, ry);
+      }
+    }
+  }
+}
+
+/* every pixel that is not black selects a cell, the mask is scaled to the map */
+int region_set_mask(struct region *r, bitfield32_map *map, char *mask_name)
+{
+  SDL_Surface *mask = load_surface(mask_name);
+  if (!mask) {
+    return -1;
+  }
+  r->cnt = 0;
+  region_reserve(r, map);
+  uint32_t *pixels = mask->pixels;
+  for (int y = 0; y < map->map_height; ++y) {
+    for (int x = 0; x < map->map_width; ++x) {
+      int mask_x = x * mask->w / map->map_width;
+      int mask_y = y * mask->h / map->map_height;
+      if (pixels[mask_y * (mask->pitch / 4) + mask_x] & 0xffffff00) {
+        r->cells[r->cnt++] = bitfield32_map_pos(map, x, y);
+      }
+    }
+  }
+  SDL_FreeSurface(mask);
+  return 0;
+}
+
+/* resets the cells of the region and makes them arc-consistent again. the
+ * cells of streamed rows are kept, see output_stream_update */
+int region_reopen(struct region *r, bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  if (glob_error_cond.error && glob_error_cond.x >= 0 && glob_error_cond.y < map->fixed_rows) {
+    /* the contradiction is in a row that is written already */
+    return -1;
+  }
+  bitfield32_map_leave_checkpoint(map);
+  uint32_t all = state_table_intern_all(map->states);
+  if (glob_error_cond.error) {
+    /* the stack holds the rest of the failed wave, a suspended wave
+     * (see solve_run) is kept and finished with the region */
+    reset_stack();
+  }
+  glob_error_cond.error = 0;
+  r->active = 1;
+  /* the cells may lie behind the scanline/spiral cursor */
+  map->cursor = 0;
+  for (int i = 0; i < r->cnt; ++i) {
+    int x;
+    int y;
+    bitfield32_map_xy(map, r->cells[i], &x, &y);
+    if (y < map->fixed_rows) {
+      continue;
+    }
+    map->map[r->cells[i]] = all;
+    bitfield32_map_touch(map, y);
+    map->reopen_y = y < map->reopen_y ? y : map->reopen_y;
+  }
+  for (int i = 0; i < r->cnt; ++i) {
+    int x;
+    int y;
+    bitfield32_map_xy(map, r->cells[i], &x, &y);
+    if (y < map->fixed_rows) {
+      continue;
+    }
+    if (-1 == update_recursive(map, x, y, res, -1, output_surface, flags)) {
+      return -1;
+    }
+    update_output_map(output_surface, x, y, map, res);
+  }
+  return 0;
+}
+
+/* like get_smalest but only looks at the cells of the region */
+float region_get_smalest(struct region *r, bitfield32_map *map, int *out_x, int *out_y)
+{
+  float smalest = 0.0;
+  for (int i = 0; i < r->cnt; ++i) {
+    bitfield32_sparse *b = &state_table_get(map->states, map->map[r->cells[i]])->bits;
+    if (b->bitcount > 1) {
+      if (smalest == 0.0 || b->entropy < smalest) {
+        bitfield32_map_xy(map, r->cells[i], out_x, out_y);
+        smalest = b->entropy;
+      }
+    }
+  }
+  r->active = smalest != 0.0;
+  return smalest;
+}
+
+/* local restart: a contradiction re-opens the block of cells around it,
+ * the block grows with every restart that runs into a contradiction
+ * again. retry_cnt counts the restarts since the last solved block */
+#define RESTART_RADIUS 2
+
+struct region glob_restart = {0};
+
+static int solve_restart(bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  while (glob_error_cond.error && glob_error_cond.x >= 0 && retry_cnt < MAX_RETRIES) {
+    int radius = RESTART_RADIUS << retry_cnt;
+    retry_cnt += 1;
+    region_set_rect(&glob_restart, map, glob_error_cond.x - radius, glob_error_cond.y - radius, 2 * radius + 1, 2 * radius + 1, flags);
+    region_reopen(&glob_restart, map, res, output_surface, flags);
+  }
+  return glob_error_cond.error ? -1 : 0;
+}
+
+/* waves started by solve_observe are suspended at this time, see solve_run */
+uint64_t glob_deadline = 0;
+
+/* observes one cell (or a batch of cells) and propagates */
+static int solve_observe(bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  int x = -1;
+  int y = -1;
+  if (glob_stack.cnt > 0) {
+    /* finish the suspended wave before the next observation */
+    return propagate_stack(map, res, output_surface, flags, glob_deadline) == -1 ? -1 : 1;
+  }
+  if (glob_restart.active) {
+    region_get_smalest(&glob_restart, map, &x, &y);
+    if (!glob_restart.active) {
+      /* the block is solved */
+      retry_cnt = 0;
+    }
+  }
+  if (x < 0 && glob_region.active) {
+    /* solve the re-opened region first */
+    region_get_smalest(&glob_region, map, &x, &y);
+  }
+  if (x < 0 && glob_propagator && glob_propagator->radius > 0 &&
+      observe_batch(map, res, output_surface, flags)) {
+    /* a batch of cells was observed */
+    return glob_error_cond.error ? -1 : 1;
+  }
+  if (x < 0) {
+    get_smalest(map, &x, &y);
+  }
+  if (x < 0) {
+    return 0;
+  }
+  /* set last set tile */
+  glob_error_cond.x0 = x;
+  glob_error_cond.y0 = y;
+  uint32_t *bf = &map->map[bitfield32_map_pos(map, x, y)];
+
+  //bitfield32_map_history_add(&glob_history, x, y, *bf, HISTORY_FLAG_SAVEPOINT);
+  *bf = state_table_intern_tile(map->states, select_tile_based_on_weight(&bitfield32_map_get(map, x, y)->bits, res));
+  update_output_map(output_surface, x, y, map, res);
+  /* update neighbours */
+  for(int dir = 0; dir < 4; ++dir) {
+    wave_push(map, DIR_X(dir, x), DIR_Y(dir, y), OPOSITE_DIRECTION(dir), flags);
+  }
+  return propagate_stack(map, res, output_surface, flags, glob_deadline) == -1 ? -1 : 1;
+}
+
+/* one solver step, contradictions are repaired by local restarts
+ * returns
+ * -1 contradiction that could not be repaired, see glob_error_cond
+ *  0 all cells are collapsed
+ *  1 a step was done
+ */
+int solve_step(bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  bitfield32_map_leave_checkpoint(map);
+  if (!glob_error_cond.error) {
+    int ret = solve_observe(map, res, output_surface, flags);
+    if (ret != -1) {
+      return ret;
+    }
+  }
+  return solve_restart(map, res, output_surface, flags) ? -1 : 1;
+}
+
+/* time budgeted solving for interactive hosts */
+struct solve_ctx {
+  bitfield32_map *map;
+  struct analyse_result *res;
+  SDL_Surface *output_surface;
+  int flags;
+  uint32_t collapsed;       /* progress after the last solve_run */
+  uint32_t total;
+};
+
+/* runs solver steps for about budget_us microseconds, a propagation wave
+ * that does not fit is suspended and continued by the next call.
+ * returns like solve_step */
+int solve_run(struct solve_ctx *ctx, int budget_us)
+{
+  int ret;
+  glob_deadline = now_us() + budget_us;
+  do {
+    ret = solve_step(ctx->map, ctx->res, ctx->output_surface, ctx->flags);
+  } while (ret == 1 && now_us() < glob_deadline);
+  glob_deadline = 0;
+  ctx->total = ctx->map->map_width * ctx->map->map_height;
+  ctx->collapsed = ctx->total - bitfield32_map_open_cells(ctx->map);
+  return ret;
+}
+
+/* coarse to fine generation
+ *
+ * COARSE=<f> analyses the input scaled down by f and solves a map of 1/f
+ * the size first, so the large structures are laid out on a small map
+ * where a contradiction is cheap. every fine cell is then narrowed to the
+ * tiles that were seen in the (untransformed) input under the colour of
+ * its coarse cell, at the same offset inside the f * f block. the guide
+ * is applied block by block, a block that contradicts its surroundings is
+ * taken back with every cell its wave reached and left to the plain
+ * solver.
+ */
+#define COARSE_BLOCK 16         /* cells, the unit a contradicting guide is dropped in */
+
+struct coarse_guide {
+  int factor;
+  struct analyse_result *res;   /* the scaled down input */
+  bitfield32_sparse *allowed;   /* fine tiles per key, see coarse_guide_key */
+  struct word_arena words;
+  uint32_t *ids;                /* allowed as states of the fine map */
+  bitfield32_map map;
+  SDL_Surface *surface;         /* preview of the coarse map, not shown */
+  struct cell_undo undo;        /* changes of the block being applied */
+};
+
+struct coarse_guide glob_coarse = {0};
+
+/* the guide is keyed by the colour of the coarse tile (its top left
+ * pixel) and the offset of the fine cell inside the f * f block */
+static int coarse_guide_key(struct coarse_guide *guide, int x, int y, int tile)
+{
+  struct analyse_result *coarse = guide->res;
+  int f = guide->factor;
+  uint32_t colour = colour_get(tile_get_data(coarse, coarse->members[coarse->member_first[tile]]), coarse->pixel_words);
+  return ((y % f) * f + x % f) * coarse->palette_count + colour;
+}
+
+/* analyses the scaled down input, returns 0 if there is nothing to guide with */
+int coarse_guide_init(struct coarse_guide *guide, char *name, int tile_size, int flags, struct analyse_result *fine)
+{
+  if (guide->factor < 2) {
+    return 0;
+  }
+  if (fine->tiled) {
+    printf("COARSE is ignored for the simple tiled model\n");
+    return 0;
+  }
+  guide->res = overlap_analyse_scaled(name, tile_size, guide->factor, flags);
+  if (!guide->res) {
+    printf("%s is too small for COARSE=%d\n", name, guide->factor);
+    return 0;
+  }
+  /* fine tiles per key, sorted by key like the members of a tile */
+  struct analyse_result *coarse = guide->res;
+  int f = guide->factor;
+  int key_cnt = f * f * coarse->palette_count;
+  int *first = calloc(key_cnt + 1, sizeof(*first));
+  int *fill = malloc(sizeof(*fill) * key_cnt);
+  int *tiles = malloc(sizeof(*tiles) * fine->map_width * fine->map_height);
+  for (int pass = 0; pass < 2; ++pass) {
+    for (uint32_t y = 0; y < fine->map_height; ++y) {
+      for (uint32_t x = 0; x < fine->map_width; ++x) {
+        uint32_t cx = x / f;
+        uint32_t cy = y / f;
+        if (cx >= coarse->map_width || cy >= coarse->map_height) {
+          continue;
+        }
+        uint32_t c = coarse->map[cy * coarse->map_width + cx];
+        uint32_t t = fine->map[y * fine->map_width + x];
+        if (c == TILE_NONE || t == TILE_NONE) {
+          continue;
+        }
+        int key = coarse_guide_key(guide, x, y, c);
+        if (pass == 0) {
+          first[key + 1] += 1;
+        } else {
+          tiles[fill[key]++] = t;
+        }
+      }
+    }
+    for (int key = 0; pass == 0 && key < key_cnt; ++key) {
+      first[key + 1] += first[key];
+      fill[key] = first[key];
+    }
+  }
+  guide->allowed = malloc(sizeof(*guide->allowed) * key_cnt);
+  guide->ids = malloc(sizeof(*guide->ids) * key_cnt);
+  bitfield32 *allowed = calloc(1, sizeof(*allowed));
+  uint64_t *data = malloc(sizeof(*data) * BITFIELD_WORDS);
+  for (int key = 0; key < key_cnt; ++key) {
+    for (int i = first[key]; i < first[key + 1]; ++i) {
+      bitfield32_set_bit(allowed, tiles[i]);
+    }
+    bitfield32_pack(allowed, &guide->allowed[key], data);
+    bitfield32_sparse_store(&guide->allowed[key], &guide->words);
+    bitfield32_clear(allowed);
+  }
+  free(data);
+  free(allowed);
+  free(tiles);
+  free(fill);
+  free(first);
+  printf("coarse: %d tiles for %d fine tiles\n", coarse->tile_count, fine->tile_count);
+  return 1;
+}
+
+/* solves the coarse map with the solver state of the fine map put aside,
+ * returns 0 if it could not be solved */
+static int coarse_guide_solve(struct coarse_guide *guide, int w, int h, int flags)
+{
+  struct parallel_propagator *propagator = glob_propagator;
+  int region_active = glob_region.active;
+  int ret = -1;
+  glob_propagator = NULL;
+  glob_region.active = 0;
+  if (!guide->surface || guide->surface->w != w || guide->surface->h != h) {
+    SDL_FreeSurface(guide->surface);
+    guide->surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA8888);
+  }
+  for (int retries = 0; ret && retries <= MAX_RETRIES; ++retries) {
+    reset_stack();
+    glob_error_cond.error = 0;
+    glob_restart.active = 0;
+    retry_cnt = 0;
+    init_bitfield32_map_cells(&guide->map, w, h, guide->res, flags);
+    if (glob_error_cond.error) {
+      break;
+    }
+    while (1 == (ret = solve_step(&guide->map, guide->res, guide->surface, flags)));
+  }
+  reset_stack();
+  glob_error_cond.error = 0;
+  glob_restart.active = 0;
+  retry_cnt = 0;
+  glob_propagator = propagator;
+  glob_region.active = region_active;
+  return ret == 0;
+}
+
+/* narrows the cells of the fine map to the solved coarse map */
+void coarse_guide_apply(struct coarse_guide *guide, bitfield32_map *map, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  int f = guide->factor;
+  int coarse_w = (map->map_width + f - 1) / f;
+  int coarse_h = (map->map_height + f - 1) / f;
+  if (!coarse_guide_solve(guide, coarse_w, coarse_h, flags)) {
+    printf("coarse map failed, solving without guide\n");
+    return;
+  }
+  /* ids of the fine state table, it may have been reset since the last time */
+  uint32_t all = state_table_intern_all(map->states);
+  for (int key = 0; key < f * f * guide->res->palette_count; ++key) {
+    guide->ids[key] = guide->allowed[key].bitcount ? state_table_intern_sparse(map->states, &guide->allowed[key]) : all;
+  }
+  /* the blocks are propagated serially and their changes recorded, so a
+   * block that contradicts its surroundings can be taken back */
+  struct parallel_propagator *propagator = glob_propagator;
+  glob_propagator = NULL;
+  map->undo = &guide->undo;
+  int dropped = 0;
+  for (int by = 0; by < map->map_height && !glob_error_cond.error; by += COARSE_BLOCK) {
+    for (int bx = 0; bx < map->map_width && !glob_error_cond.error; bx += COARSE_BLOCK) {
+      guide->undo.cnt = 0;
+      for (int y = by; y < by + COARSE_BLOCK && y < map->map_height; ++y) {
+        for (int x = bx; x < bx + COARSE_BLOCK && x < map->map_width; ++x) {
+          bitfield32_iter iter = bitfield32_get_iter(&bitfield32_map_get(&guide->map, x / f, y / f)->bits);
+          int key = coarse_guide_key(guide, x, y, bitfield32_iter_next(&iter));
+          uint32_t pos = bitfield32_map_pos(map, x, y);
+          uint32_t v = state_and(map->states, map->map[pos], guide->ids[key]);
+          if (v == map->map[pos] || state_table_get(map->states, v)->bits.bitcount == 0) {
+            /* a guide that contradicts the border is dropped for the cell */
+            continue;
+          }
+          wave_changed(map, pos);
+          map->map[pos] = v;
+          for (int dir = 0; dir < 4; ++dir) {
+            wave_push(map, DIR_X(dir, x), DIR_Y(dir, y), OPOSITE_DIRECTION(dir), flags);
+          }
+        }
+      }
+      if (propagate_stack(map, res, output_surface, flags, 0) == -1) {
+        /* every cell the wave reached goes back to the value before the
+         * block, which was arc-consistent. the block is solved unguided */
+        dropped += 1;
+        reset_stack();
+        glob_error_cond.error = 0;
+        for (uint32_t i = 0; i < guide->undo.cnt; ++i) {
+          int x;
+          int y;
+          map->map[guide->undo.pos[i]] = guide->undo.value[i];
+          bitfield32_map_xy(map, guide->undo.pos[i], &x, &y);
+          update_output_map(output_surface, x, y, map, res);
+        }
+      }
+    }
+  }
+  map->undo = NULL;
+  glob_propagator = propagator;
+  printf("coarse: %d of %d blocks left unguided\n", dropped,
+      ((map->map_width + COARSE_BLOCK - 1) / COARSE_BLOCK) * ((map->map_height + COARSE_BLOCK - 1) / COARSE_BLOCK));
+}
+
+/* all cells narrowed by their distance to the border and by the coarse
+ * map if there is a guide */
+void init_bitfield32_map(bitfield32_map *map, int w, int h, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+{
+  init_bitfield32_map_cells(map, w, h, res, flags);
+  if (glob_coarse.res && !glob_error_cond.error) {
+    coarse_guide_apply(&glob_coarse, map, res, output_surface, flags);
+  }
+}
+
+/* streaming output
+ *
+ * finished rows are written as soon as every cell of a band of rows is
+ * collapsed, only one band is kept in memory. the first not collapsed cell
+ * is remembered, so checking costs O(1) per cell over the whole solve.
+ * formats: png, raw rgba (4 bytes per cell) and a raw tile id grid
+ * (little-endian uint32 per cell). with the simple tiled model png and
+ * rgba contain every pixel of the tiles.
+ */
+enum stream_format {STREAM_PNG, STREAM_RGBA, STREAM_IDS, STREAM_FORMATS};
+
+struct output_stream {
+  char *name;
+  FILE *fp;
+  int band_height;
+  int next_x;               /* first cell not known to be collapsed */
+  int next_y;
+  int written_rows;
+  int scale;                /* image pixels per cell */
+  int row_size;             /* bytes per encoded row */
+  uint8_t *band;
+  z_stream z;
+  uint8_t *zbuf;
+  size_t zbuf_size;
+};
+
+struct output_stream glob_streams[STREAM_FORMATS] = {{0}};
+
+static void png_put_u32(uint8_t *out, uint32_t v)
+{
+  out[0] = v >> 24;
+  out[1] = v >> 16;
+  out[2] = v >> 8;
+  out[3] = v;
+}
+
+static void png_write_chunk(FILE *fp, char *type, uint8_t *data, uint32_t len)
+{
+  uint8_t head[8];
+  uint8_t tail[4];
+  png_put_u32(head, len);
+  memcpy(&head[4], type, 4);
+  uint32_t crc = crc32(0, &head[4], 4);
+  if (len) {
+    /* crc32 with NULL data resets to the initial value */
+    crc = crc32(crc, data, len);
+  }
+  png_put_u32(tail, crc);
+  fwrite(head, 1, 8, fp);
+  if (len) {
+    fwrite(data, 1, len, fp);
+  }
+  fwrite(tail, 1, 4, fp);
+}
+
+/* deflates in and writes the output as IDAT chunks */
+static void png_deflate(struct output_stream *stream, uint8_t *in, size_t len, int flush)
+{
+  stream->z.next_in = in;
+  stream->z.avail_in = len;
+  do {
+    stream->z.next_out = stream->zbuf;
+    stream->z.avail_out = stream->zbuf_size;
+    deflate(&stream->z, flush);
+    size_t have = stream->zbuf_size - stream->z.avail_out;
+    if (have) {
+      png_write_chunk(stream->fp, "IDAT", stream->zbuf, have);
+    }
+  } while (stream->z.avail_out == 0);
+}
+
+int output_stream_open(struct output_stream *stream, int format, bitfield32_map *map)
+{
+  stream->fp = fopen(stream->name, "wb");
+  if (!stream->fp) {
+    return -1;
+  }
+  stream->next_x = 0;
+  stream->next_y = 0;
+  stream->written_rows = 0;
+  if (!stream->band_height) {
+    stream->band_height = 16;
+  }
+  struct analyse_result *res = map->states->res;
+  stream->scale = (format != STREAM_IDS && res->tiled) ? res->tile_size : 1;
+  stream->row_size = map->map_width * stream->scale * 4 + (format == STREAM_PNG);
+  stream->band = realloc(stream->band, stream->row_size * stream->band_height * stream->scale);
+  if (format == STREAM_PNG) {
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t ihdr[13];
+    png_put_u32(&ihdr[0], map->map_width * stream->scale);
+    png_put_u32(&ihdr[4], map->map_height * stream->scale);
+    ihdr[8] = 8;                /* bit depth */
+    ihdr[9] = 6;                /* rgba */
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+    fwrite(signature, 1, sizeof(signature), stream->fp);
+    png_write_chunk(stream->fp, "IHDR", ihdr, sizeof(ihdr));
+    memset(&stream->z, 0, sizeof(stream->z));
+    deflateInit(&stream->z, Z_DEFAULT_COMPRESSION);
+    stream->zbuf_size = 64 * 1024;
+    stream->zbuf = realloc(stream->zbuf, stream->zbuf_size);
+  }
+  return 0;
+}
+
+void output_stream_close(struct output_stream *stream, int format)
+{
+  if (!stream->fp) {
+    return;
+  }
+  if (format == STREAM_PNG) {
+    if (stream->written_rows == -1) {
+      png_write_chunk(stream->fp, "IEND", NULL, 0);
+    }
+    deflateEnd(&stream->z);
+  }
+  fclose(stream->fp);
+  stream->fp = NULL;
+}
+
+/* the pattern of a collapsed cell, the same for every stream */
+static int bitfield32_map_pattern(bitfield32_map *map, int x, int y)
+{
+  bitfield32_iter iter = bitfield32_get_iter(&bitfield32_map_get(map, x, y)->bits);
+  return tile_pick_pattern(map->states->res, bitfield32_iter_next(&iter),
+      murmur3_32((uint8_t*)(uint32_t[]){x, y}, 2 * sizeof(uint32_t), map->pattern_seed));
+}
+
+/* one pixel row of every tile in the map row y */
+static uint8_t *output_stream_put_tiles(struct output_stream *stream, bitfield32_map *map, int y, int tile_y, uint8_t *out)
+{
+  struct analyse_result *res = map->states->res;
+  for (int x = 0; x < map->map_width; ++x) {
+    colour_index *tile_row = &tile_get_data(res, bitfield32_map_pattern(map, x, y))[tile_y * stream->scale * res->pixel_words];
+    for (int tile_x = 0; tile_x < stream->scale; ++tile_x) {
+      png_put_u32(out, res->palette[colour_get(&tile_row[tile_x * res->pixel_words], res->pixel_words)]);
+      out += 4;
+    }
+  }
+  return out;
+}
+
+static void output_stream_write_band(struct output_stream *stream, int format, bitfield32_map *map, int y0, int y1)
+{
+  uint8_t *out = stream->band;
+  for (int y = y0; y < y1; ++y) {
+    if (stream->scale > 1) {
+      for (int tile_y = 0; tile_y < stream->scale; ++tile_y) {
+        if (format == STREAM_PNG) {
+          *out++ = 0;           /* filter: none */
+        }
+        out = output_stream_put_tiles(stream, map, y, tile_y, out);
+      }
+      continue;
+    }
+    if (format == STREAM_PNG) {
+      *out++ = 0;               /* filter: none */
+    }
+    for (int x = 0; x < map->map_width; ++x) {
+      uint32_t id = map->map[bitfield32_map_pos(map, x, y)];
+      uint32_t v;
+      if (format == STREAM_IDS) {
+        v = bitfield32_map_pattern(map, x, y);
+        out[0] = v;
+        out[1] = v >> 8;
+        out[2] = v >> 16;
+        out[3] = v >> 24;
+      } else {
+        png_put_u32(out, state_get_colour(map->states, id));
+      }
+      out += 4;
+    }
+  }
+  if (format == STREAM_PNG) {
+    png_deflate(stream, stream->band, out - stream->band, y1 == map->map_height ? Z_FINISH : Z_NO_FLUSH);
+  } else {
+    fwrite(stream->band, 1, out - stream->band, stream->fp);
+  }
+  fflush(stream->fp);
+}
+
+/* writes all bands that are completely collapsed */
+void output_stream_update(struct output_stream *stream, int format, bitfield32_map *map)
+{
+  if (map->reopen_y < stream->next_y) {
+    /* region_reopen keeps the written rows, only the cursor goes back */
+    stream->next_x = 0;
+    stream->next_y = map->reopen_y;
+  }
+  if (!stream->fp || stream->written_rows == -1) {
+    return;
+  }
+  while (stream->next_y < map->map_height) {
+    while (stream->next_x < map->map_width && bitfield32_map_get(map, stream->next_x, stream->next_y)->bits.bitcount == 1) {
+      stream->next_x += 1;
+    }
+    if (stream->next_x < map->map_width) {
       break;
     }
+    stream->next_x = 0;
+    stream->next_y += 1;
   }
-  if (!history->last) {
-    history->first = NULL;
+  while (stream->next_y - stream->written_rows >= stream->band_height ||
+      (stream->next_y == map->map_height && stream->written_rows < map->map_height)) {
+    int y1 = stream->written_rows + stream->band_height;
+    y1 = y1 < stream->next_y ? y1 : stream->next_y;
+    output_stream_write_band(stream, format, map, stream->written_rows, y1);
+    stream->written_rows = y1;
+  }
+  map->fixed_rows = stream->written_rows > map->fixed_rows ? stream->written_rows : map->fixed_rows;
+  if (stream->written_rows == map->map_height) {
+    /* done */
+    stream->written_rows = -1;
+    output_stream_close(stream, format);
   }
-  return ret;
 }
 
-int bitfield32_map_history_add(bitfield32_history *history, int x, int y, bitfield32 value, int flags)
+/* flags shared by the command line and daemon jobs, returns 0 for unknown flags */
+int parse_flag(char *arg, int *flags)
 {
-  bitfield32_history_element *e = NULL;
-  if (history->cnt == MAX_HISTORY) {
-    e = history->first;
-    history->first = e->next;
-    history->first->prev = NULL;
-    e->next = NULL;
+  if (!strcasecmp(arg, "ROTATE")) {
+    *flags |= ANALYZE_FLAG_DO_ROTATE;
+  } else if (!strcasecmp(arg, "MIRROR_V")) {
+    *flags |= ANALYZE_FLAG_DO_MIRROR_V;
+  } else if (!strcasecmp(arg, "MIRROR_H")) {
+    *flags |= ANALYZE_FLAG_DO_MIRROR_H;
+  } else if (!strcasecmp(arg, "NO_V_WRAP")) {
+    *flags |= ANALYZE_FLAG_NO_Y_WRAP;
+  } else if (!strcasecmp(arg, "NO_H_WRAP")) {
+    *flags |= ANALYZE_FLAG_NO_X_WRAP;
+  } else if (!strcasecmp(arg, "SEAMLESS")) {
+    *flags |= OUTPUT_FLAG_MAKE_SEAMLESS;
+  } else if (!strcasecmp(arg, "TILED")) {
+    *flags |= ANALYZE_FLAG_TILED;
+  } else if (!strcasecmp(arg, "REVERSE")) {
+    get_smalest = bitfield32_map_get_smales_entropy_pos_last;
+  } else if (!strcasecmp(arg, "SELECT=entropy")) {
+    get_smalest = bitfield32_map_get_smales_entropy_pos;
+  } else if (!strcasecmp(arg, "SELECT=noise")) {
+    get_smalest = bitfield32_map_get_smales_entropy_noise_pos;
+  } else if (!strcasecmp(arg, "SELECT=mrv")) {
+    get_smalest = bitfield32_map_get_smales_bitcount_pos;
+  } else if (!strcasecmp(arg, "SELECT=scanline")) {
+    get_smalest = bitfield32_map_get_scanline_pos;
+  } else if (!strcasecmp(arg, "SELECT=spiral")) {
+    get_smalest = bitfield32_map_get_spiral_pos;
+  } else if (!strncasecmp(arg, "COARSE=", 7)) {
+    glob_coarse.factor = strtol(arg + 7, NULL, 10);
   } else {
-    history->cnt += 1;
-    //printf("-> ++ %d %d\n", history->cnt, flags);
-    while (!e) {
-      bitfield32_history_element *test =  &history->e[(history->pos ++)%MAX_HISTORY];
-      if (!(test->flags & HISTORY_FLAG_IN_USE)) {
-        e = test;
-      }
-    }
-  }
-  e->x = x;
-  e->y = y;
-  e->value = value;
-  e->flags = flags | HISTORY_FLAG_IN_USE;
-  if (flags & HISTORY_FLAG_SAVEPOINT) {
-    e->id = history->last_id ++;
-  }
-  e->prev = history->last;
-  if (history->last) {
-    history->last->next = e;
-  }
-  history->last = e;
-  if (!history->first) {
-    history->first = e;
+    return 0;
   }
-  return 0;
+  return 1;
 }
 
-bitfield32_history glob_history = {0};
-int retry_cnt = 0;
-int last_id = 0;
-int rollback_cnt = 0;
-#define MAX_RETRIES 10
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
-/* this binary-ands map position x/y with value and update neighbours recursively */
-/* returns
- * -1 tile out of range
- *  0 nothing changed
- *  1 value was modified
+/* batch generation service
+ *
+ * jobs are read line by line from stdin or from the clients of a unix
+ * socket:
+ *   <image> <tile_size> <w> <h> <output> [SEED=<n>] [flags]
+ * analysed images are kept in a small lru cache, together with the coarse
+ * analysis of the last COARSE factor asked for. every job is solved in a
+ * forked child, so the solver globals are private to the job and the
+ * cached rulesets are shared copy-on-write. at most WORKERS jobs run at
+ * once, each one reports a single line:
+ *   ok|error <output> analyse=<ms> solve=<ms> retries=<n>
+ * the output format follows the extension: .png, .rgba, .ids or bmp.
  */
+#define DAEMON_MAX_ARGS 32
 
-struct error_condition {
-  int error;
-  int x;
-  int y;
-  int x0;
-  int y0;
-} glob_error_cond = {0};
-
-
-#define STACK_SIZE 10000
-struct update_stack_data {
-  int x;
-  int y;
-  int from_dir;
+struct ruleset_cache_entry {
+  char *image_name;
+  int tile_size;
+  int flags;                /* analysis flags only */
+  time_t mtime;             /* a changed image is analysed again */
+  uint64_t last_used;
+  struct analyse_result *res;
+  struct coarse_guide coarse;   /* analysis for COARSE=coarse.factor, never solved */
 };
 
-struct update_stack {
-  int start;
-  int cnt;
-  struct update_stack_data stack[STACK_SIZE];
+struct ruleset_cache {
+  int size;
+  uint64_t clock;
+  struct ruleset_cache_entry *entries;
 };
 
-struct update_stack glob_stack = {0};
-
-void push_stack(int x, int y, int from_dir)
+static double elapsed_ms(struct timespec *start)
 {
-  assert(glob_stack.cnt < STACK_SIZE);
-  int stack_pos = (glob_stack.start + glob_stack.cnt) % STACK_SIZE;
-  glob_stack.stack[stack_pos].x = x;
-  glob_stack.stack[stack_pos].y = y;
-  glob_stack.stack[stack_pos].from_dir = from_dir;
-  ++ glob_stack.cnt;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
 }
 
-int pop_stack(int *x, int *y, int *from_dir)
+void analyse_result_free(struct analyse_result *res)
 {
-  if (glob_stack.cnt <= 0) {
-    return 0;
+  free(res->tile_data);
+  free(res->palette);
+  free(res->hashes);
+  free(res->members);
+  free(res->member_first);
+  free(res->member_weights);
+  free(res->weights);
+  free(res->weight_log_weights);
+  free(res->colours);
+  free(res->rects);
+  free(res->allowed_neighbours);
+  word_arena_free(&res->words);
+  free(res->map);
+  if (res->texture) {
+    SDL_DestroyTexture(res->texture);
   }
-  *x = glob_stack.stack[glob_stack.start].x;
-  *y = glob_stack.stack[glob_stack.start].y;
-  *from_dir = glob_stack.stack[glob_stack.start].from_dir;
-  glob_stack.start = (glob_stack.start + 1) % STACK_SIZE;
-  -- glob_stack.cnt;
-  return 1;
-}
-
-void reset_stack(void)
-{
-  glob_stack.cnt = 0;
-  glob_stack.start = 0;
+  free(res);
 }
 
-int update_map_with_rules(bitfield32_map *map, int x, int y, struct analyse_result *res, int from_dir, SDL_Surface *output_surface, int flags);
-
-int update_recursive(bitfield32_map *map, int x, int y, struct analyse_result *res, int from_dir, SDL_Surface *output_surface, int flags)
+/* frees the analysis of a guide that was never solved */
+void coarse_guide_free(struct coarse_guide *guide)
 {
-  push_stack(x, y, from_dir);
-  while (pop_stack(&x, &y, &from_dir)) {
-    switch (update_map_with_rules(map, x, y, res, from_dir, output_surface, flags)) {
-      case -1:
-        /* ERROR condition */
-        glob_error_cond.x = x;
-        glob_error_cond.y = y;
-        glob_error_cond.error = 1;
-        printf("error condition\n");
-        return -1;
-      case 0:
-        break;
-      case 1:
-        /* value changed push things to stack */
-        for (int dir = 0 ; dir < 4; ++dir) {
-          if (dir == from_dir)
-            continue;
-          int test_x = DIR_X(dir, x);
-          int test_y = DIR_Y(dir, y);
-          push_stack(test_x, test_y, OPOSITE_DIRECTION(dir));
-        }
-        break;
-    }
+  if (guide->res) {
+    analyse_result_free(guide->res);
   }
-  return 0;
+  free(guide->allowed);
+  word_arena_free(&guide->words);
+  free(guide->ids);
+  free(guide->undo.pos);
+  free(guide->undo.value);
+  memset(guide, 0, sizeof(*guide));
 }
 
-/* what's happening here?
- *
- */
-int update_map_with_rules(bitfield32_map *map, int x, int y, struct analyse_result *res, int from_dir, SDL_Surface *output_surface, int flags)
+/* returns the entry of the analysed image, analyses it on a miss */
+struct ruleset_cache_entry *ruleset_cache_get(struct ruleset_cache *cache, char *image_name, int tile_size, int flags)
 {
-  /* wo dont evaluate any tiles that are out-of-map */
-  if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
-    /* normalize map (wrap) */
-    while (x < 0) {
-      x += map->map_width;
+  struct stat st;
+  if (stat(image_name, &st)) {
+    return NULL;
+  }
+  flags &= ANALYZE_FLAGS;
+  struct ruleset_cache_entry *victim = &cache->entries[0];
+  for (int i = 0; i < cache->size; ++i) {
+    struct ruleset_cache_entry *e = &cache->entries[i];
+    if (e->res && e->tile_size == tile_size && e->flags == flags &&
+        e->mtime == st.st_mtime && !strcmp(e->image_name, image_name)) {
+      e->last_used = ++cache->clock;
+      return e;
     }
-    while (y < 0) {
-      y += map->map_height;
+    if (victim->res && (!e->res || e->last_used < victim->last_used)) {
+      victim = e;
     }
-    x %= map->map_width;
-    y %= map->map_height;
-  } else if (x < 0 || x >= map->map_width || y < 0 || y >= map->map_height) {
-    return 0;
   }
-
-  bitfield32 *map_element = &map->map[y * map->map_width + x];
-
-  /* we dont modifie tiles when there are already collapsed (bitcount == 1) */
-  if (bitfield32_get_bitcount(map_element) == 1) {
-    return 0;
+  struct analyse_result *res = overlap_analyse_image(image_name, tile_size, flags);
+  if (!res) {
+    return NULL;
+  }
+  if (victim->res) {
+    analyse_result_free(victim->res);
+    coarse_guide_free(&victim->coarse);
+    free(victim->image_name);
   }
+  victim->image_name = strdup(image_name);
+  victim->tile_size = tile_size;
+  victim->flags = flags;
+  victim->mtime = st.st_mtime;
+  victim->last_used = ++cache->clock;
+  victim->res = res;
+  return victim;
+}
 
-  bitfield32 old_value = *map_element;
+/* the coarse analysis of a cached image, analysed again if the factor changed */
+static struct coarse_guide *ruleset_cache_coarse(struct ruleset_cache_entry *e, int factor)
+{
+  if (e->coarse.factor != factor) {
+    coarse_guide_free(&e->coarse);
+    e->coarse.factor = factor;
+    coarse_guide_init(&e->coarse, e->image_name, e->tile_size, e->flags, e->res);
+  }
+  return &e->coarse;
+}
 
-  for (int dir = 0; dir < 4; ++dir) {
-    int test_x = DIR_X(dir, x);
-    int test_y = DIR_Y(dir, y);
-    if (flags & OUTPUT_FLAG_MAKE_SEAMLESS) {
-      while (test_x < 0) {
-        test_x += map->map_width;
-      }
-      while (test_y < 0) {
-        test_y += map->map_height;
-      }
-      test_x %= map->map_width;
-      test_y %= map->map_height;
-    }
-    if (test_x >= 0 && test_x < map->map_width && test_y >= 0 && test_y < map->map_height) {
-      bitfield32_and(map_element, &map->cache[map->map_width * test_y + test_x][OPOSITE_DIRECTION(dir)]);
-    }
+static int daemon_write_output(bitfield32_map *map, SDL_Surface *output_surface, char *output)
+{
+  char *ext = strrchr(output, '.');
+  int format = -1;
+  if (ext && !strcasecmp(ext, ".png")) {
+    format = STREAM_PNG;
+  } else if (ext && !strcasecmp(ext, ".rgba")) {
+    format = STREAM_RGBA;
+  } else if (ext && !strcasecmp(ext, ".ids")) {
+    format = STREAM_IDS;
+  } else {
+    return SDL_SaveBMP(output_surface, output);
   }
-  if (!bitfield32_cmp(&old_value, map_element)) {
-    /* add changed value to history */
-    //bitfield32_map_history_add(&glob_history, x, y, old_value, 0);
-    update_output_map(output_surface, x, y, map, res);
-    update_allowed_neighbours_cache(map, x, y, res);
-    switch (bitfield32_get_bitcount(map_element)) {
-      case 0:
-#if 0
-        /* ERROR condition */
-        glob_error_cond.x = x;
-        glob_error_cond.y = y;
-        glob_error_cond.error = 1;
-        printf("error condition\n");
-#endif
-        return -1;
-      case 1:
-        /* resolved */
-        map_element->entropy = 0.0;
-        break;
-      default:
-        /* recalculate entropy */
-        /* XXX ugly XXX */
-        map_element->entropy = get_entropy(map_element, res);
-        break;
-    }
-#if 0
-    /* update neighbours */
-    for (int dir = 0; dir < 4; ++dir) {
-      if (dir == from_dir)
-        continue;
-      int test_x = DIR_X(dir, x);
-      int test_y = DIR_Y(dir, y);
-      if (-1 == update_map_with_rules(map, test_x, test_y, res, OPOSITE_DIRECTION(dir), output_surface, flags)) {
-        return -1;
-      }
-    }
-#endif
-    return 1;
+  struct output_stream stream = {0};
+  stream.name = output;
+  if (output_stream_open(&stream, format, map)) {
+    return -1;
   }
+  /* all cells are collapsed, this writes every band */
+  output_stream_update(&stream, format, map);
+  output_stream_close(&stream, format);
+  free(stream.band);
+  free(stream.zbuf);
   return 0;
 }
 
-void init_bitfield32_map(bitfield32_map *map, int w, int h, struct analyse_result *res, SDL_Surface *output_surface, int flags)
+/* runs in the forked child */
+static void daemon_run_job(struct analyse_result *res, int w, int h, int flags, char *output, double analyse_ms, int result_fd)
 {
-  map->map_width = w;
-  map->map_height = h;
-  map->map = calloc(1, sizeof(*map->map) * w * h);
-  /* fill with all possibilities */
-  bitfield32 tmp_v = {0};
-  printf("initialize bitfield\n");
-  for(int b = 0; b < res->tile_count; ++b) {
-    bitfield32_set_bit(&tmp_v, b);
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  SDL_Surface *output_surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_RGBA8888);
+  bitfield32_map map = {0};
+  int retries = 0;
+  int ret;
+  for (;;) {
+    init_bitfield32_map(&map, w, h, res, output_surface, flags);
+    while (1 == (ret = solve_step(&map, res, output_surface, flags)));
+    if (ret == 0 || retries == MAX_RETRIES) {
+      break;
+    }
+    /* the local restarts failed, start over */
+    retries += 1;
+    reset_stack();
+    glob_error_cond.error = 0;
+    glob_restart.active = 0;
+    retry_cnt = 0;
   }
-  for (int i = 0; i < w * h; ++i) {
-    map->map[i] = tmp_v;
+  if (ret == 0) {
+    ret = daemon_write_output(&map, output_surface, output);
   }
-  printf("initialize neighbour-cache\n");
-  init_allowed_neighbours_cache(map, res);
-  /* initial update */
-  printf("initial update\n");
-  for(int y = 0; y < h; ++y) {
-    for (int x = 0; x < w; ++x) {
-     if (-1 == update_recursive(map, x, y, res, -1, output_surface, flags)) {
-       printf("error\n");
-       return;
-     }
-    }
+  char line[4096];
+  int len = snprintf(line, sizeof(line), "%s %s analyse=%.1f solve=%.1f retries=%d\n",
+      ret == 0 ? "ok" : "error", output, analyse_ms, elapsed_ms(&start), retries);
+  if (write(result_fd, line, len) != len) {
+    perror("write");
   }
-  printf("initial entropy calc\n");
-  /* calculate entropy */
-  for(int i = 0; i < w * h; ++i) {
-    /* XXX ugly XXX */
-    map->map[i].entropy = get_entropy(&map->map[i], res);
+}
+
+static void daemon_report(int result_fd, char *status, char *what)
+{
+  char line[4096];
+  int len = snprintf(line, sizeof(line), "%s %s\n", status, what);
+  if (write(result_fd, line, len) != len) {
+    perror("write");
   }
-  printf("done\n");
 }
 
-float bitfield32_map_get_smales_entropy_pos_last(bitfield32_map *map, int *out_x, int *out_y)
+/* runs the jobs of one input, returns when all of them are done */
+static void daemon_serve(FILE *in, int result_fd, struct ruleset_cache *cache, int workers)
 {
-  float smalest = 0.0;
-  for (int y = 0; y <  map->map_height; ++y) {
-    for (int x = 0; x < map->map_width; ++x) {
-      bitfield32 *b = &map->map[y * map->map_width + x];
-      if (bitfield32_get_bitcount(b) > 1) {
-        if (smalest == 0.0 || b->entropy <= smalest) {
-          *out_x = x;
-          *out_y = y;
-          smalest = b->entropy;
-        }
+  char line[4096];
+  int running = 0;
+  float (*default_smalest)(bitfield32_map *map, int *out_x, int *out_y) = get_smalest;
+  int default_coarse = glob_coarse.factor;
+  while (fgets(line, sizeof(line), in)) {
+    char *args[DAEMON_MAX_ARGS];
+    int argc = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok && argc < DAEMON_MAX_ARGS; tok = strtok_r(NULL, " \t\r\n", &save)) {
+      args[argc++] = tok;
+    }
+    if (argc == 0 || args[0][0] == '#') {
+      continue;
+    }
+    if (argc < 5) {
+      daemon_report(result_fd, "error", "usage: <image> <tile_size> <w> <h> <output> [SEED=<n>] [flags]");
+      continue;
+    }
+    int tile_size = strtol(args[1], NULL, 10);
+    int w = strtol(args[2], NULL, 10);
+    int h = strtol(args[3], NULL, 10);
+    int flags = 0;
+    int seeded = 0;
+    unsigned int seed = 0;
+    int ok = tile_size > 0 && w > 0 && h > 0;
+    for (int i = 5; i < argc && ok; ++i) {
+      if (!strncasecmp(args[i], "SEED=", 5)) {
+        seed = strtoul(args[i] + 5, NULL, 10);
+        seeded = 1;
+      } else {
+        ok = parse_flag(args[i], &flags);
       }
     }
+    /* REVERSE and COARSE only apply to this job */
+    float (*job_smalest)(bitfield32_map *map, int *out_x, int *out_y) = get_smalest;
+    get_smalest = default_smalest;
+    int job_coarse = glob_coarse.factor;
+    glob_coarse.factor = default_coarse;
+    if (!ok) {
+      daemon_report(result_fd, "error", args[4]);
+      continue;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct ruleset_cache_entry *entry = ruleset_cache_get(cache, args[0], tile_size, flags);
+    if (!entry) {
+      daemon_report(result_fd, "error", args[4]);
+      continue;
+    }
+    struct analyse_result *res = entry->res;
+    struct coarse_guide *coarse = ruleset_cache_coarse(entry, job_coarse);
+    double analyse_ms = elapsed_ms(&start);
+    for (; running >= workers; --running) {
+      wait(NULL);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      srand(seeded ? seed : (unsigned int)time(NULL) ^ (unsigned int)getpid());
+      get_smalest = job_smalest;
+      /* the child solves on its own copy of the cached guide */
+      glob_coarse = *coarse;
+      daemon_run_job(res, w, h, flags, args[4], analyse_ms, result_fd);
+      _exit(0);
+    } else if (pid < 0) {
+      daemon_report(result_fd, "error", args[4]);
+    } else {
+      running += 1;
+    }
+  }
+  for (; running > 0; --running) {
+    wait(NULL);
   }
-  return smalest;
 }
 
-
-float bitfield32_map_get_smales_entropy_pos(bitfield32_map *map, int *out_x, int *out_y)
+int daemon_main(int argc, char **argv)
 {
-  float smalest = 0.0;
-  for (int y = 0; y <  map->map_height; ++y) {
-    for (int x = 0; x < map->map_width; ++x) {
-      bitfield32 *b = &map->map[y * map->map_width + x];
-      if (bitfield32_get_bitcount(b) > 1) {
-        if (smalest == 0.0 || b->entropy < smalest) {
-          *out_x = x;
-          *out_y = y;
-          smalest = b->entropy;
-        }
-      }
+  char *socket_name = NULL;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  struct ruleset_cache cache = {0};
+  cache.size = 8;
+  for (int i = 2; i < argc; ++i) {
+    if (!strncasecmp(argv[i], "SOCKET=", 7)) {
+      socket_name = argv[i] + 7;
+    } else if (!strncasecmp(argv[i], "WORKERS=", 8)) {
+      workers = strtol(argv[i] + 8, NULL, 10);
+    } else if (!strncasecmp(argv[i], "CACHE=", 6)) {
+      cache.size = strtol(argv[i] + 6, NULL, 10);
+    } else {
+      printf("illegal flag us: SOCKET=<path> WORKERS=<n> CACHE=<n>\n");
+      return 1;
     }
   }
-  return smalest;
+  workers = workers > 0 ? workers : 1;
+  cache.size = cache.size > 0 ? cache.size : 1;
+  cache.entries = calloc(cache.size, sizeof(*cache.entries));
+  signal(SIGPIPE, SIG_IGN);
+  /* stdout carries the results, the solver output goes to stderr */
+  int result_fd = dup(1);
+  dup2(2, 1);
+  if (!socket_name) {
+    daemon_serve(stdin, result_fd, &cache, workers);
+    return 0;
+  }
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_name, sizeof(addr.sun_path) - 1);
+  unlink(socket_name);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+    perror(socket_name);
+    return 1;
+  }
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      continue;
+    }
+    FILE *in = fdopen(conn, "r");
+    daemon_serve(in, conn, &cache, workers);
+    fclose(in);
+  }
+  return 0;
 }
 
-float (*get_smalest)(bitfield32_map *map, int *out_x, int *out_y) = bitfield32_map_get_smales_entropy_pos;
-
-
-#include <time.h>
 int main(int argc, char **argv) {
 #if 1
+  if (argc >= 2 && !strcasecmp(argv[1], "DAEMON")) {
+    return daemon_main(argc, argv);
+  }
   if (argc < 5) {
-    printf("Usage\ncollapse <image> <tile_size> <w> <h> [flags]\n");
+    printf("Usage\ncollapse <image> <tile_size> <w> <h> [flags]\ncollapse DAEMON [SOCKET=<path>] [WORKERS=<n>] [CACHE=<n>]\n");
     return -1;
   }
   char *image_name = argv[1];
@@ -1073,25 +4695,46 @@ int main(int argc, char **argv) {
   int map_w = 0;
   int map_h = 0;
   int flags = 0;
+  int thread_cnt = 1;
+  int batch_radius = 0;
+  SDL_Rect region_rect = {0};
+  char *region_mask = NULL;
+  int band_height = 16;
+  char *map_file = NULL;
+  int block_shift = -1;
+  int morton = 0;
+  int budget_us = 8000;
   map_w = strtol(argv[3], NULL, 10);
   map_h = strtol(argv[4], NULL, 10);
   for (int i=5 ; i < argc; ++i) {
-    if (!strcasecmp(argv[i], "ROTATE")) {
-      flags |= ANALYZE_FLAG_DO_ROTATE;
-    } else if (!strcasecmp(argv[i], "MIRROR_V")) {
-      flags |= ANALYZE_FLAG_DO_MIRROR_V;
-    } else if (!strcasecmp(argv[i], "MIRROR_H")) {
-      flags |= ANALYZE_FLAG_DO_MIRROR_H;
-    } else if (!strcasecmp(argv[i], "NO_V_WRAP")) {
-      flags |= ANALYZE_FLAG_NO_Y_WRAP;
-    } else if (!strcasecmp(argv[i], "NO_H_WRAP")) {
-      flags |= ANALYZE_FLAG_NO_X_WRAP;
-    } else if (!strcasecmp(argv[i], "SEAMLESS")) {
-      flags |= OUTPUT_FLAG_MAKE_SEAMLESS;
-    } else if (!strcasecmp(argv[i], "REVERSE")) {
-      get_smalest = bitfield32_map_get_smales_entropy_pos_last;
+    if (parse_flag(argv[i], &flags)) {
+      /* analysis and output flags */
+    } else if (!strncasecmp(argv[i], "THREADS=", 8)) {
+      thread_cnt = strtol(argv[i] + 8, NULL, 10);
+    } else if (!strncasecmp(argv[i], "BATCH=", 6)) {
+      batch_radius = strtol(argv[i] + 6, NULL, 10);
+    } else if (!strncasecmp(argv[i], "REGION=", 7)) {
+      sscanf(argv[i] + 7, "%d,%d,%d,%d", &region_rect.x, &region_rect.y, &region_rect.w, &region_rect.h);
+    } else if (!strncasecmp(argv[i], "MASK=", 5)) {
+      region_mask = argv[i] + 5;
+    } else if (!strncasecmp(argv[i], "PNG=", 4)) {
+      glob_streams[STREAM_PNG].name = argv[i] + 4;
+    } else if (!strncasecmp(argv[i], "RGBA=", 5)) {
+      glob_streams[STREAM_RGBA].name = argv[i] + 5;
+    } else if (!strncasecmp(argv[i], "IDS=", 4)) {
+      glob_streams[STREAM_IDS].name = argv[i] + 4;
+    } else if (!strncasecmp(argv[i], "BAND=", 5)) {
+      band_height = strtol(argv[i] + 5, NULL, 10);
+    } else if (!strncasecmp(argv[i], "MMAP=", 5)) {
+      map_file = argv[i] + 5;
+    } else if (!strncasecmp(argv[i], "BLOCK=", 6)) {
+      block_shift = strtol(argv[i] + 6, NULL, 10);
+    } else if (!strcasecmp(argv[i], "MORTON")) {
+      morton = 1;
+    } else if (!strncasecmp(argv[i], "BUDGET=", 7)) {
+      budget_us = strtol(argv[i] + 7, NULL, 10);
     } else {
-      printf("illegal flag us: ROTATE MIRROR_V MIRROR_H NO_V_WRAP NO_H_WRAP SEAMLESS REVERSE\n");
+      printf("illegal flag us: ROTATE MIRROR_V MIRROR_H NO_V_WRAP NO_H_WRAP SEAMLESS TILED REVERSE SELECT=<entropy|noise|mrv|scanline|spiral> THREADS=<n> BATCH=<radius> REGION=<x>,<y>,<w>,<h> MASK=<image> PNG=<file> RGBA=<file> IDS=<file> BAND=<rows> MMAP=<file> BLOCK=<shift> MORTON BUDGET=<us> COARSE=<factor>\n");
       exit(1);
     }
   }
@@ -1109,24 +4752,56 @@ int main(int argc, char **argv) {
 
   //struct analyse_result *test = analyse_image(image_name, tile_size);
   struct analyse_result *overlap_result = overlap_analyse_image(image_name, tile_size, flags);
+  if (!overlap_result) {
+    printf("unable to load %s\n", image_name);
+    exit(1);
+  }
  // print_analyse_result(test);
  printf("tile_cnt = %d\n", overlap_result->tile_count);
+  coarse_guide_init(&glob_coarse, image_name, tile_size, flags, overlap_result);
 
   bitfield32_map bf_map = {0};
+  /* disk backed and z-ordered cells default to 32x32 blocks, one page each */
+  bf_map.file_name = map_file;
+  bf_map.block_shift = block_shift >= 0 ? block_shift : ((map_file || morton) ? 5 : 0);
+  bf_map.morton = morton;
   SDL_Texture *output_texture = SDL_CreateTexture(glob_renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, map_w, map_h);
   SDL_Surface *output_surface = SDL_CreateRGBSurfaceWithFormat(0, map_w, map_h, 32, SDL_PIXELFORMAT_RGBA8888);
 
-  init_bitfield32_map(&bf_map, map_w, map_h, overlap_result, output_surface, flags);
-
-  for( int tmp_y = 0; tmp_y < map_h; ++ tmp_y) {
-    for (int tmp_x = 0; tmp_x < map_w; ++tmp_x) {
-      update_output_map(output_surface, tmp_x, tmp_y, &bf_map, overlap_result);
+  if (!bitfield32_map_resume(&bf_map, map_w, map_h, overlap_result)) {
+    init_bitfield32_map(&bf_map, map_w, map_h, overlap_result, output_surface, flags);
+  }
+  glob_propagator = parallel_propagator_create(&bf_map, output_surface, flags, thread_cnt);
+  if (glob_propagator && batch_radius > 0) {
+    parallel_propagator_set_radius(glob_propagator, batch_radius);
+  }
+  /* region re-generated by 'r' */
+  if (region_mask) {
+    if (region_set_mask(&glob_region, &bf_map, region_mask)) {
+      printf("unable to load mask %s\n", region_mask);
+      exit(1);
+    }
+  } else {
+    region_set_rect(&glob_region, &bf_map, region_rect.x, region_rect.y, region_rect.w, region_rect.h, flags);
+  }
+  SDL_Point drag_start = {-1, -1};
+  /* rows streamed to disk as they finish */
+  for (int format = 0; format < STREAM_FORMATS; ++format) {
+    struct output_stream *stream = &glob_streams[format];
+    stream->band_height = band_height > 0 ? band_height : 1;
+    if (stream->name && output_stream_open(stream, format, &bf_map)) {
+      printf("unable to open %s\n", stream->name);
+      exit(1);
     }
   }
 
+  draw_map_with_weight(&bf_map, output_surface);
+
   memset(&glob_history, 0, sizeof(glob_history));
   retry_cnt = 0;
   last_id = 0;
+  struct solve_ctx solve = {&bf_map, overlap_result, output_surface, flags};
+  uint32_t shown_percent = -1;
   while (running) {
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
@@ -1144,21 +4819,47 @@ int main(int argc, char **argv) {
                (SCREEN_HEIGHT/scale)/test->tile_size, test, flags);
           }
 #endif
-          free(bf_map.map);
           init_bitfield32_map(&bf_map, map_w, map_h, overlap_result, output_surface, flags);
-          for( int tmp_y = 0; tmp_y < map_h; ++ tmp_y) {
-            for (int tmp_x = 0; tmp_x < map_w; ++tmp_x) {
-              update_output_map(output_surface, tmp_x, tmp_y, &bf_map, overlap_result);
-            }
-          }
+          draw_map_with_weight(&bf_map, output_surface);
           glob_error_cond.error = 0;
           memset(&glob_history, 0, sizeof(glob_history));
           retry_cnt = 0;
+          glob_restart.active = 0;
           last_id = 0;
           /* reset stack */
           reset_stack();
+          /* start the streams over */
+          for (int format = 0; format < STREAM_FORMATS; ++format) {
+            if (glob_streams[format].name) {
+              output_stream_close(&glob_streams[format], format);
+              output_stream_open(&glob_streams[format], format, &bf_map);
+            }
+          }
           } else if (event.key.keysym.sym == 's') {
             SDL_SaveBMP(output_surface, "out.bmp");
+          } else if (event.key.keysym.sym == 'c') {
+            if (bitfield32_map_checkpoint(&bf_map)) {
+              printf("checkpoint failed\n");
+            }
+          } else if (event.key.keysym.sym == 'r') {
+            region_reopen(&glob_region, &bf_map, overlap_result, output_surface, flags);
+          }
+          break;
+        case SDL_MOUSEBUTTONDOWN:
+          drag_start.x = event.button.x * map_w / (SCREEN_WIDTH / 8);
+          drag_start.y = event.button.y * map_h / (SCREEN_HEIGHT / 8);
+          break;
+        case SDL_MOUSEBUTTONUP:
+          if (drag_start.x >= 0) {
+            /* re-generate the dragged rectangle */
+            int drag_x = event.button.x * map_w / (SCREEN_WIDTH / 8);
+            int drag_y = event.button.y * map_h / (SCREEN_HEIGHT / 8);
+            region_set_rect(&glob_region, &bf_map,
+                drag_start.x < drag_x ? drag_start.x : drag_x,
+                drag_start.y < drag_y ? drag_start.y : drag_y,
+                abs(drag_x - drag_start.x) + 1, abs(drag_y - drag_start.y) + 1, flags);
+            region_reopen(&glob_region, &bf_map, overlap_result, output_surface, flags);
+            drag_start.x = -1;
           }
           break;
         case SDL_QUIT:
@@ -1169,36 +4870,34 @@ int main(int argc, char **argv) {
    // SDL_SetRenderDrawColor(glob_renderer, 100, 100, 100, 255);
     SDL_RenderClear(glob_renderer);
      //SDL_RenderCopy(glob_renderer, overlap_result->texture, NULL, NULL);
-    //draw_map_with_weight(&bf_map, overlap_result);
     // draw_input_map(test);
-    int x = 0;
-    int y = 0;
-    if (!glob_error_cond.error && 0.0 < get_smalest(&bf_map, &x, &y)) {
-      /* set last set tile */
-      glob_error_cond.x0 = x;
-      glob_error_cond.y0 = y;
-      bitfield32 *bf = &bf_map.map[y * bf_map.map_width + x];
-
-      //bitfield32_map_history_add(&glob_history, x, y, *bf, HISTORY_FLAG_SAVEPOINT);
-      bitfield32_set_to(bf, select_tile_based_on_weight(bf, overlap_result));
-      bf->entropy = 0.0;
-      update_allowed_neighbours_cache(&bf_map, x, y, overlap_result);
-      update_output_map(output_surface, x, y, &bf_map, overlap_result);
-      /* update neighbours */
-      for(int dir = 0; dir < 4; ++dir) {
-         int test_x = DIR_X(dir, x);
-         int test_y = DIR_Y(dir, y);
-         if (-1 == update_recursive(&bf_map, test_x, test_y, overlap_result, OPOSITE_DIRECTION(dir), output_surface, flags)) {
-           break;
-         }
-      }
+    /* on errors wait for SPACE or a re-generated region */
+    solve_run(&solve, budget_us);
+    if ((uint64_t)solve.collapsed * 100 / solve.total != shown_percent) {
+      char title[32];
+      shown_percent = (uint64_t)solve.collapsed * 100 / solve.total;
+      snprintf(title, sizeof(title), "Collapse %u%%", shown_percent);
+      SDL_SetWindowTitle(glob_window, title);
     }
-    //draw_map_with_weight(&bf_map, overlap_result);
-    SDL_UpdateTexture(output_texture, NULL, output_surface->pixels, 4 * output_surface->w);
+    for (int format = 0; format < STREAM_FORMATS; ++format) {
+      output_stream_update(&glob_streams[format], format, &bf_map);
+    }
+    bf_map.reopen_y = bf_map.map_height;
+    update_output_texture(output_texture, output_surface, &bf_map);
     SDL_RenderCopy(glob_renderer, output_texture, NULL, NULL);
     SDL_RenderPresent(glob_renderer);
   }
 
+  if (glob_propagator) {
+    parallel_propagator_free(glob_propagator);
+  }
+  for (int format = 0; format < STREAM_FORMATS; ++format) {
+    output_stream_close(&glob_streams[format], format);
+  }
+  if (bf_map.file) {
+    bitfield32_map_checkpoint(&bf_map);
+    bitfield32_map_free(&bf_map);
+  }
   SDL_Quit();
 
 #else
@@ -1209,7 +4908,10 @@ int main(int argc, char **argv) {
   for (int i = 0; i < 128; ++i) {
     bitfield32_unset_bit(&bf, i);
   }
-  bitfield32_iter iter = bitfield32_get_iter(&bf);
+  uint64_t data[BITFIELD_WORDS];
+  bitfield32_sparse packed;
+  bitfield32_pack(&bf, &packed, data);
+  bitfield32_iter iter = bitfield32_get_iter(&packed);
   for (int i = bitfield32_iter_next(&iter); i != -1; i = bitfield32_iter_next(&iter)) {
     printf("-> bit %d set\n", i);
   }